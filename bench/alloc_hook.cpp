@@ -0,0 +1,35 @@
+#include <atomic>
+#include <cstddef>
+
+#include "alloc_hook.hpp"
+
+// glibc's real allocator, we forward to it after counting. operator new ends
+// up in malloc so this catches the C++ allocations too
+extern "C" void* __libc_malloc( std::size_t size );
+extern "C" void* __libc_calloc( std::size_t n, std::size_t size );
+extern "C" void* __libc_realloc( void* p, std::size_t size );
+
+static std::atomic<uint64_t> alloc_count( 0 );
+
+extern "C" void* malloc( std::size_t size )
+{
+    alloc_count.fetch_add( 1, std::memory_order_relaxed );
+    return __libc_malloc( size );
+}
+
+extern "C" void* calloc( std::size_t n, std::size_t size )
+{
+    alloc_count.fetch_add( 1, std::memory_order_relaxed );
+    return __libc_calloc( n, size );
+}
+
+extern "C" void* realloc( void* p, std::size_t size )
+{
+    alloc_count.fetch_add( 1, std::memory_order_relaxed );
+    return __libc_realloc( p, size );
+}
+
+uint64_t allocations()
+{
+    return alloc_count.load( std::memory_order_relaxed );
+}
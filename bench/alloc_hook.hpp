@@ -0,0 +1,7 @@
+#pragma once
+
+#include <cstdint>
+
+// number of malloc/calloc/realloc calls so far. alloc_hook.cpp interposes the
+// allocator (glibc only) so a benchmark can prove a path doesn't allocate
+uint64_t allocations();
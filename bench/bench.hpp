@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// results get folded in here so the optimizer can't throw the work away
+extern volatile std::size_t bench_sink;
+
+// how the benches are run, set from the command line
+struct bench_config
+{
+    unsigned    repeat = 5;     // timed runs per bench, the median is reported
+    std::string filter;         // only benches whose name contains this
+};
+
+extern bench_config bench_settings;
+
+inline bool bench_selected( const std::string& name )
+{
+    return name.find( bench_settings.filter ) != std::string::npos;
+}
+
+struct bench_result
+{
+    double per_op = 0;      // median ns
+    double spread = 0;      // slowest run less the fastest, % of the median
+};
+
+// run fn() iterations times, repeat times over after a warm up of a tenth
+// as many. one call can be ops_per_call ops (a batch of msgs, say)
+template<typename F>
+bench_result measure_bench( unsigned long iterations, F fn, unsigned long ops_per_call = 1 )
+{
+    iterations = std::max( iterations, 1ul );
+
+    for( unsigned long i = 0; i < std::max( iterations / 10, 1ul ); ++i )
+    {
+        fn();
+    }
+
+    std::vector<double> runs;
+
+    for( unsigned r = 0; r < std::max( bench_settings.repeat, 1u ); ++r )
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        for( unsigned long i = 0; i < iterations; ++i )
+        {
+            fn();
+        }
+
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        runs.push_back( elapsed.count() / ( iterations * ops_per_call ) );
+    }
+
+    std::sort( runs.begin(), runs.end() );
+
+    bench_result result;
+    result.per_op = runs[runs.size() / 2];
+    result.spread = result.per_op > 0 ? 100 * ( runs.back() - runs.front() ) / result.per_op : 0;
+
+    return result;
+}
+
+inline void report_bench( const std::string& name, const bench_result& result, const std::string& note = "" )
+{
+    std::cout << std::left << std::setw( 44 ) << name
+              << std::right << std::setw( 14 ) << std::fixed << std::setprecision( 1 ) << result.per_op << " ns/op"
+              << "  +-" << std::setprecision( 1 ) << result.spread / 2 << "%"
+              << note << std::endl;
+}
+
+// measure and print the median cost of a single op. returns it, or 0 if
+// the filter skipped this one
+template<typename F>
+double run_bench( const std::string& name, unsigned long iterations, F fn, unsigned long ops_per_call = 1 )
+{
+    if( ! bench_selected( name ) )
+    {
+        return 0;
+    }
+
+    bench_result result = measure_bench( iterations, fn, ops_per_call );
+    report_bench( name, result );
+
+    return result.per_op;
+}
+
+// how much faster after is than before, if both ran
+inline void print_speedup( double before, double after )
+{
+    if( before > 0 && after > 0 )
+    {
+        std::cout << "    speedup: " << std::setprecision( 1 ) << before / after << "x" << std::endl;
+    }
+}
@@ -0,0 +1,762 @@
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <streambuf>
+#include <thread>
+#include <vector>
+
+#include <sched.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <boost/program_options.hpp>
+#include <msgpack.hpp>
+
+#include "common.hpp"
+#include "message_reader.hpp"
+#include "member_table.hpp"
+#include "frame.hpp"
+#include "server.hpp"
+#include "logger.hpp"
+#include "alloc_hook.hpp"
+#include "bench.hpp"
+
+volatile std::size_t bench_sink = 0;
+bench_config bench_settings;
+
+chat_message make_message()
+{
+    chat_message msg;
+    msg.nickname = "hammer-42";
+    msg.message = "the quick brown fox jumps over the lazy dog, msg num 12345";
+    return msg;
+}
+
+// what chat_room::deliver used to cost, every member copies the message
+// and packs it again
+void fanout_per_member( const chat_message& msg, std::size_t members )
+{
+    for( std::size_t i = 0; i < members; ++i )
+    {
+        chat_message copy = msg;
+        msgpack::sbuffer packer;
+        msgpack::pack( packer, copy );
+        bench_sink += packer.size();
+    }
+}
+
+// pack once, every member just takes a reference to the same bytes
+void fanout_encode_once( const chat_message& msg, std::vector<std::shared_ptr<const msgpack::sbuffer>>& queues )
+{
+    auto frame = std::make_shared<msgpack::sbuffer>();
+    msgpack::pack( *frame, msg );
+
+    for( auto& slot : queues )
+    {
+        slot = frame;
+    }
+
+    bench_sink += frame->size();
+}
+
+void bench_fanout()
+{
+    chat_message msg = make_message();
+
+    for( std::size_t members : { 10, 1000, 5000 } )
+    {
+        unsigned long iterations = 2000000 / members;
+        std::vector<std::shared_ptr<const msgpack::sbuffer>> queues( members );
+
+        std::stringstream ss;
+        ss << "fanout/" << members;
+
+        double before = run_bench( ss.str() + "/per_member", iterations, [&]() { fanout_per_member( msg, members ); } );
+        double after  = run_bench( ss.str() + "/encode_once", iterations, [&]() { fanout_encode_once( msg, queues ); } );
+
+        print_speedup( before, after );
+    }
+}
+
+// stands in for chat_session, just enough to see the cost of reaching it
+class mock_member
+{
+public:
+    mock_member() : received( 0 ) {}
+
+    void deliver( const std::shared_ptr<const msgpack::sbuffer>& frame )
+    {
+        received += frame->size();
+    }
+
+    std::size_t received;
+};
+
+typedef std::shared_ptr<mock_member> mock_ptr;
+
+void bench_members()
+{
+    auto frame = std::make_shared<msgpack::sbuffer>();
+    msgpack::pack( *frame, make_message() );
+
+    for( std::size_t members : { 10, 1000, 50000 } )
+    {
+        unsigned long iterations = 5000000 / members;
+
+        std::set<mock_ptr> set;
+        member_table<mock_member> table;
+        std::vector<mock_ptr> owners;
+        std::vector<member_table<mock_member>::handle> handles;
+
+        for( std::size_t i = 0; i < members; ++i )
+        {
+            auto member = std::make_shared<mock_member>();
+            set.insert( member );
+            owners.push_back( member );
+            handles.push_back( table.insert( member ) );
+        }
+
+        mock_member* sender = owners[0].get();
+
+        std::stringstream ss;
+        ss << "members/" << members;
+
+        // the old chat_room::deliver, copies every shared_ptr out of the set
+        double before = run_bench( ss.str() + "/set_fanout", iterations, [&]()
+        {
+            for( auto member : set )
+            {
+                if( member.get() != sender )
+                {
+                    member->deliver( frame );
+                }
+            }
+        } );
+
+        double after = run_bench( ss.str() + "/table_fanout", iterations, [&]()
+        {
+            for( mock_member* member : table )
+            {
+                if( member != sender )
+                {
+                    member->deliver( frame );
+                }
+            }
+        } );
+
+        print_speedup( before, after );
+
+        // leave and rejoin a member from the middle of the room
+        mock_ptr victim = owners[members / 2];
+        member_table<mock_member>::handle handle = handles[members / 2];
+
+        run_bench( ss.str() + "/set_leave_join", iterations * 10, [&]()
+        {
+            set.erase( victim );
+            set.insert( victim );
+        } );
+
+        run_bench( ss.str() + "/table_leave_join", iterations * 10, [&]()
+        {
+            table.erase( handle );
+            handle = table.insert( victim );
+        } );
+
+        for( mock_member* member : table )
+        {
+            bench_sink += member->received;
+        }
+    }
+}
+
+// a loopback connection the room bench's sessions all write to, each
+// through its own dup of our end, with a thread reading the other end so
+// the writes complete like they would to peers that keep up
+class sink
+{
+public:
+    explicit sink( boost::asio::io_service& ios )
+        : m_ios( ios ),
+          m_out( ios ),
+          m_in( m_reader_ios )
+    {
+        tcp::acceptor acceptor( m_reader_ios, tcp::endpoint( boost::asio::ip::address_v4::loopback(), 0 ) );
+        m_out.connect( acceptor.local_endpoint() );
+        acceptor.accept( m_in );
+
+        m_reader = std::thread( [this]()
+        {
+            std::vector<char> buffer( 1024 * 1024 );
+            boost::system::error_code ec;
+
+            while( ! ec )
+            {
+                m_in.read_some( boost::asio::buffer( buffer ), ec );
+            }
+        } );
+    }
+
+    ~sink()
+    {
+        // every dup shares the one connection, this is the reader's eof
+        boost::system::error_code ignored;
+        m_out.shutdown( tcp::socket::shutdown_send, ignored );
+        m_reader.join();
+    }
+
+    // a socket on the io_service that writes into the sink
+    tcp::socket socket()
+    {
+        int fd = ::dup( m_out.native_handle() );
+
+        if( fd < 0 )
+        {
+            throw boost::system::system_error( errno, boost::system::system_category(), "dup" );
+        }
+
+        tcp::socket s( m_ios );
+        s.assign( tcp::v4(), fd );
+        return s;
+    }
+
+private:
+    boost::asio::io_service&    m_ios;
+    boost::asio::io_service     m_reader_ios;
+    tcp::socket                 m_out;
+    tcp::socket                 m_in;
+    std::thread                 m_reader;
+};
+
+// chat_room's deliver, join and leave as the server runs them, over real
+// chat_sessions on the one shard of a one thread io_service_pool. the bench
+// thread stands in for the shard's thread: the pool isn't run, it's polled
+// every write_every ops so the writes in flight complete and what queued up
+// behind them goes out, like a reader that keeps up
+void bench_room()
+{
+    enum { write_every = 64 };
+
+    // join and leave log at info, what that costs is log/'s business
+    Logger::instance().set_level( Logger::warning );
+
+    io_service_pool pool( 1 );
+    boost::asio::io_service& ios = pool.get_io_service( 0 );
+    shard_exchange exchange( pool );
+    room_registry registry( ios, pool, exchange );
+    session_table shard_sessions;
+    server_options options;
+    sink out( ios );
+
+    // every member holds a descriptor
+    rlimit files;
+    getrlimit( RLIMIT_NOFILE, &files );
+    files.rlim_cur = files.rlim_max;
+    setrlimit( RLIMIT_NOFILE, &files );
+    getrlimit( RLIMIT_NOFILE, &files );
+
+    mutable_frame_t frame = frame::make();
+    msgpack::pack( *frame, make_message() );
+    frame->count = 1;
+
+    for( std::size_t members : { 10, 1000, 10000 } )
+    {
+        std::stringstream ss;
+        ss << "room/" << members;
+
+        if( ! bench_selected( ss.str() + "/deliver" ) && ! bench_selected( ss.str() + "/leave_join" ) )
+        {
+            continue;
+        }
+
+        if( files.rlim_cur < members + 64 )
+        {
+            std::cout << ss.str() << " skipped, needs " << members + 64 << " open files" << std::endl;
+            continue;
+        }
+
+        unsigned long iterations = 5000000 / members;
+
+        room_ptr room = std::make_shared<chat_room>( ss.str(), pool, exchange, nullptr, 32 );
+        std::vector<chat_session::pointer> sessions;
+        std::vector<member_handle> handles;
+
+        frame->stamp( room->id(), framing::chat );
+
+        for( std::size_t i = 0; i < members; ++i )
+        {
+            // never start()ed, so they don't read or time out, they only
+            // take part in the room
+            sessions.push_back( std::make_shared<chat_session>( out.socket(), registry, room, options, 0,
+                                                              pool.get_timer_wheel( 0 ), shard_sessions ) );
+            handles.push_back( room->join( sessions.back() ) );
+        }
+
+        chat_session::pointer sender = sessions[0];
+        unsigned long ops = 0;
+
+        run_bench( ss.str() + "/deliver", iterations, [&]()
+        {
+            room->deliver( sender, frame );
+
+            if( ++ops % write_every == 0 )
+            {
+                ios.poll();
+            }
+        } );
+
+        // a member from the middle leaves and comes back, catching up on
+        // the scrollback as it does
+        chat_session::pointer member = sessions[members / 2];
+        member_handle& handle = handles[members / 2];
+
+        run_bench( ss.str() + "/leave_join", iterations * 10, [&]()
+        {
+            room->leave( member, handle );
+            handle = room->join( member );
+
+            if( ++ops % write_every == 0 )
+            {
+                ios.poll();
+            }
+        } );
+
+        for( std::size_t i = 0; i < members; ++i )
+        {
+            room->leave( sessions[i], handles[i] );
+            sessions[i]->close();
+        }
+
+        // the cancelled writes hand back the last references
+        sessions.clear();
+        member.reset();
+        sender.reset();
+        ios.poll();
+    }
+}
+
+// something like what users paste, log lines that repeat a lot but not
+// exactly
+std::string make_log_paste( std::size_t size )
+{
+    std::string paste;
+    unsigned n = 0;
+
+    while( paste.size() < size )
+    {
+        std::stringstream ss;
+        ss << "2026-10-18 12:00:" << std::setw( 2 ) << std::setfill( '0' ) << ( n / 40 ) % 60 << "." << ( n * 7919 ) % 1000
+           << " INFO  server.cpp:" << 200 + n % 50 << " room(lobby)-10.0." << n % 7 << "." << n % 251
+           << ":" << 40000 + n * 13 % 20000 << ": delivering " << n % 17 << " msgs\n";
+        paste += ss.str();
+        n++;
+    }
+
+    paste.resize( size );
+    return paste;
+}
+
+// what one msg costs on the way in and out, for a few sizes
+void bench_serialize()
+{
+    for( std::size_t size : { 64, 1024, 16384 } )
+    {
+        chat_message msg = make_message();
+        msg.message = make_log_paste( size );
+
+        unsigned long iterations = 20000000 / ( size + 200 );
+
+        std::stringstream ss;
+        ss << "serialize/" << size;
+
+        msgpack::sbuffer out;
+
+        run_bench( ss.str() + "/pack", iterations, [&]()
+        {
+            out.clear();
+            msgpack::pack( out, msg );
+            bench_sink += out.size();
+        } );
+
+        chat_message_view view;
+        view.nickname = msg.nickname;
+        view.message = msg.message;
+
+        run_bench( ss.str() + "/pack_view", iterations, [&]()
+        {
+            out.clear();
+            msgpack::pack( out, view );
+            bench_sink += out.size();
+        } );
+
+        msgpack::sbuffer packed;
+        msgpack::pack( packed, msg );
+
+        // a fresh zone per msg and a copy of both strings
+        double before = run_bench( ss.str() + "/unpack_copy", iterations, [&]()
+        {
+            msgpack::unpacked unpacked;
+            msgpack::unpack( unpacked, packed.data(), packed.size() );
+
+            chat_message copy;
+            unpacked.get().convert( &copy );
+            bench_sink += copy.message.size();
+        } );
+
+        // message_reader, views into its buffer, fed a read's worth at a time
+        enum { batch = 64 };
+        msgpack::sbuffer wire;
+
+        for( int i = 0; i < batch; ++i )
+        {
+            msgpack::pack( wire, msg );
+        }
+
+        message_reader reader;
+
+        double after = run_bench( ss.str() + "/reader_view", iterations / batch + 1, [&]()
+        {
+            std::size_t off = 0;
+            chat_message_view got;
+
+            while( off < wire.size() )
+            {
+                auto buffer = reader.prepare();
+                std::size_t length = std::min( boost::asio::buffer_size( buffer ), wire.size() - off );
+
+                std::copy( wire.data() + off, wire.data() + off + length, boost::asio::buffer_cast<char*>( buffer ) );
+                reader.commit( length );
+                off += length;
+
+                while( reader.next( got ) )
+                {
+                    bench_sink += got.message.size();
+                }
+            }
+        }, batch );
+
+        print_speedup( before, after );
+    }
+}
+
+// what each codec costs to compress a frame once, against the bytes it
+// saves on every recipient's copy
+void bench_compression()
+{
+    for( std::size_t size : { 256, 1024, 4096, 16384, 65536 } )
+    {
+        chat_message msg = make_message();
+        msg.message = make_log_paste( size );
+
+        msgpack::sbuffer packed;
+        msgpack::pack( packed, msg );
+
+        unsigned long iterations = 20000000 / ( size + 1000 );
+
+        for( int c = compression::lz4; c < compression::num_codecs; ++c )
+        {
+            compression::codec_t codec = compression::codec_t( c );
+            std::vector<char> out;
+            std::vector<char> back;
+
+            std::stringstream ss;
+            ss << "compress/" << compression::name( codec ) << "/" << size;
+
+            if( ! bench_selected( ss.str() ) && ! bench_selected( "de" + ss.str() ) )
+            {
+                continue;
+            }
+
+            if( ! compression::compress( codec, packed.data(), packed.size(), out ) )
+            {
+                std::cout << ss.str() << " doesn't shrink" << std::endl;
+                continue;
+            }
+
+            run_bench( ss.str(), iterations, [&]()
+            {
+                compression::compress( codec, packed.data(), packed.size(), out );
+                bench_sink += out.size();
+            } );
+
+            ss.str( "" );
+            ss << "decompress/" << compression::name( codec ) << "/" << size;
+
+            run_bench( ss.str(), iterations, [&]()
+            {
+                compression::decompress( codec, out.data(), out.size(), back, framing::max_payload );
+                bench_sink += back.size();
+            } );
+
+            std::cout << "    " << packed.size() << " -> " << out.size() << " bytes, ratio "
+                      << std::setprecision( 3 ) << double( out.size() ) / packed.size()
+                      << ", saves " << packed.size() - out.size() << " bytes per recipient" << std::endl;
+        }
+    }
+}
+
+// where the console writer's output goes while an enabled record is timed
+class null_buffer : public std::streambuf
+{
+protected:
+    int overflow( int c ) override { return c; }
+    std::streamsize xsputn( const char*, std::streamsize n ) override { return n; }
+};
+
+// prints like chat_session does, room and remote endpoint
+struct log_session
+{
+    std::string room;
+    std::string endpoint;
+
+    friend std::ostream& operator<<( std::ostream& out, const log_session& obj )
+    {
+        out << "room(" << obj.room << ")-" << obj.endpoint;
+        return out;
+    }
+};
+
+// what the per message TL_S_TRACE in chat_session::do_read costs when the
+// level is info, i.e. the record gets filtered out
+void bench_log()
+{
+    enum { iterations = 10000000 };
+
+    Logger::instance().set_level( Logger::info );
+
+    chat_message msg = make_message();
+    chat_message_view view;
+    view.nickname = msg.nickname;
+    view.message = msg.message;
+
+    log_session self{ "lobby", "127.0.0.1:54321" };
+
+    // the old TL_STREAM, straight into boost::log's filter
+    run_bench( "log/boost_filter", iterations, [&]()
+    {
+        BOOST_LOG_SEV( _logger::get(), Logger::trace ) << __FILE__ << ":" << __LINE__ << " " << self << ": " << view;
+    } );
+
+    if( Logger::trace <= TL_MIN_LEVEL )
+    {
+        run_bench( "log/tl_s_trace", iterations, [&]()
+        {
+            TL_S_TRACE << self << ": " << view;
+        } );
+    }
+    else if( bench_selected( "log/tl_s_trace" ) )
+    {
+        std::cout << "log/tl_s_trace compiled out (TL_MIN_LEVEL " << TL_MIN_LEVEL << ")" << std::endl;
+    }
+
+    if( ! bench_selected( "log/tl_s_info" ) )
+    {
+        return;
+    }
+
+    // an enabled record all the way into the console's ring. the writer
+    // thread's output goes nowhere, what's left is the caller's cost. if the
+    // writer falls behind the ring fills and we're timing drops instead,
+    // which is what the dropped count is for
+    null_buffer discard;
+    std::streambuf* console = std::cout.rdbuf( &discard );
+    uint64_t dropped = Logger::instance().dropped();
+
+    bench_result result = measure_bench( iterations / 10, [&]()
+    {
+        TL_S_INFO << self << ": " << view;
+    } );
+
+    std::this_thread::sleep_for( std::chrono::milliseconds( 100 ) ); // let the writer drain
+    std::cout.rdbuf( console );
+
+    std::stringstream note;
+    note << "  (" << Logger::instance().dropped() - dropped << " dropped)";
+    report_bench( "log/tl_s_info", result, note.str() );
+}
+
+// stands in for chat_session's write queue
+class relay_member
+{
+public:
+    std::vector<frame_t> queue;
+};
+
+// push one pass of wire bytes through the same steps chat_session takes:
+// read into the unpacker, decode views, pack into a pooled frame, queue the
+// frame on every member, then "finish the write" and drop them. the wire
+// is fed in read_size chunks
+std::size_t relay_pass( const msgpack::sbuffer& wire, std::size_t read_size, message_reader& reader,
+                        member_table<relay_member>& room )
+{
+    std::size_t relayed = 0;
+
+    for( std::size_t off = 0; off < wire.size(); off += read_size )
+    {
+        std::size_t length = std::min<std::size_t>( read_size, wire.size() - off );
+
+        auto buffer = reader.prepare();
+        std::copy( wire.data() + off, wire.data() + off + length, boost::asio::buffer_cast<char*>( buffer ) );
+        reader.commit( length );
+
+        chat_message_view msg;
+        mutable_frame_t frame;
+
+        while( reader.next( msg ) )
+        {
+            if( ! frame )
+            {
+                frame = frame::make();
+            }
+
+            msgpack::pack( *frame, msg );
+            relayed++;
+        }
+
+        if( frame )
+        {
+            for( relay_member* member : room )
+            {
+                member->queue.push_back( frame );
+            }
+        }
+
+        for( relay_member* member : room )
+        {
+            member->queue.clear();
+        }
+    }
+
+    return relayed;
+}
+
+// the steady state relay path must not malloc per message. when reads end
+// on a message boundary the unpacker rewinds its buffer and nothing is
+// allocated at all. when a message straddles the end of a full buffer the
+// unpacker moves it into a fresh one, that's one malloc per buffer, anything
+// per message would show up as ~1 alloc/msg
+bool check_relay_allocs()
+{
+    enum { num_msgs = 100000, num_members = 100 };
+
+    msgpack::sbuffer wire;
+    chat_message msg = make_message();
+
+    for( int i = 0; i < num_msgs; ++i )
+    {
+        msgpack::pack( wire, msg );
+    }
+
+    member_table<relay_member> room;
+
+    for( int i = 0; i < num_members; ++i )
+    {
+        room.insert( std::make_shared<relay_member>() );
+    }
+
+    std::size_t msg_size = wire.size() / num_msgs;
+    bool all_ok = true;
+
+    for( std::size_t read_size : { 4096 / msg_size * msg_size, std::size_t( 4096 ) } )
+    {
+        bool aligned = read_size % msg_size == 0;
+        message_reader reader;
+
+        relay_pass( wire, read_size, reader, room ); // warm up the pools and queues
+
+        uint64_t before = allocations();
+        std::size_t relayed = relay_pass( wire, read_size, reader, room );
+        uint64_t allocs = allocations() - before;
+
+        double per_msg = double( allocs ) / relayed;
+        bool ok = aligned ? allocs == 0 : per_msg < 0.01;
+
+        std::cout << "relay" << ( aligned ? " (reads on msg boundaries): " : ": " )
+                  << relayed << " msgs to " << num_members << " members, "
+                  << allocs << " allocs, " << std::setprecision( 4 ) << per_msg << " allocs/msg "
+                  << ( ok ? "OK" : "FAIL" ) << std::endl;
+
+        all_ok = all_ok && ok;
+    }
+
+    return all_ok;
+}
+
+namespace po = boost::program_options;
+
+bool parse_cmd_line( int argc, char** argv, po::variables_map& opts )
+{
+    po::options_description desc( "bench options" );
+
+    desc.add_options()
+    ( "help,h", "show help" )
+    ( "filter,f", po::value<std::string>()->default_value( "" ), "only run benches whose name contains this, e.g. room/ or serialize/1024" )
+    ( "repeat,r", po::value<unsigned>()->default_value( 5 ), "timed runs per bench, the median is reported" )
+    ( "cpu", po::value<int>()->default_value( -1 ), "pin to this cpu so the scheduler doesn't move us mid run, -1 to leave it alone" )
+    ;
+
+    try
+    {
+        po::store( po::parse_command_line( argc, argv, desc ), opts );
+
+        if( opts.count( "help" ) )
+        {
+            std::cout << "usage: bench [options]" << std::endl;
+            std::cout << desc << std::endl;
+            exit( 0 );
+        }
+
+        po::notify( opts );
+    }
+    catch( std::exception& e )
+    {
+        std::cerr << e.what() << std::endl;
+        std::cerr << desc << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+int main( int argc, char* argv[] )
+{
+    po::variables_map opts;
+
+    if( ! parse_cmd_line( argc, argv, opts ) )
+    {
+        return 1;
+    }
+
+    bench_settings.filter = opts["filter"].as<std::string>();
+    bench_settings.repeat = opts["repeat"].as<unsigned>();
+
+    int cpu = opts["cpu"].as<int>();
+
+    if( cpu >= 0 )
+    {
+        cpu_set_t set;
+        CPU_ZERO( &set );
+        CPU_SET( cpu, &set );
+
+        if( sched_setaffinity( 0, sizeof( set ), &set ) != 0 )
+        {
+            std::cerr << "couldn't pin to cpu " << cpu << ", carrying on unpinned" << std::endl;
+        }
+    }
+
+    bench_serialize();
+    bench_fanout();
+    bench_members();
+    bench_room();
+    bench_log();
+    bench_compression();
+
+    if( bench_selected( "relay" ) && ! check_relay_allocs() )
+    {
+        return 1;
+    }
+
+    return 0;
+}
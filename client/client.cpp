@@ -16,13 +16,20 @@ using asio::ip::tcp;
 
 posix_chat_client::posix_chat_client( asio::io_service& io_service,
                                       tcp::resolver::iterator endpoint_iterator,
-                                      std::string nickname )
+                                      std::string nickname,
+                                      bool framed,
+                                      compression::codec_t codec )
     : m_socket( io_service ),
       m_stdin( io_service, ::dup( STDIN_FILENO ) ),
       m_stdout( io_service, ::dup( STDOUT_FILENO ) ),
-      m_input_buffer( max_msg_length )
+      m_input_buffer( max_msg_length ),
+      m_writing( false ),
+      m_input_waiting( false )
 {
     m_nickname = nickname;
+    m_framed_out = framed;
+    m_framed_in = false;
+    m_codec = codec;
 
     // attempt to connect to server, call handle_connect when we do
     auto handler = boost::bind( &posix_chat_client::handle_connect, this, asio::placeholders::error );
@@ -37,14 +44,29 @@ void posix_chat_client::handle_connect( const boost::system::error_code& error )
         return;
     }
 
+    if( m_framed_out )
+    {
+        // still plain, everything we send after this is framed
+        m_packer.clear();
+        std::string features = framing::feature;
+
+        if( m_codec != compression::none )
+        {
+            features += std::string( "," ) + compression::name( m_codec );
+        }
+
+        msgpack::pack( m_packer, control_message( control_message::hello, features ) );
+        asio::write( m_socket, asio::buffer( m_packer.data(), m_packer.size() ) );
+    }
+
     listen_on_socket();
     listen_on_input();
 }
 
 void posix_chat_client::listen_on_socket()
 {
-    // read from socket
-    auto buffer = asio::buffer( m_read_buffer, 1024 );
+    // read from socket, straight into the unpacker (or frame reader)
+    auto buffer = m_framed_in ? m_frames.prepare() : m_reader.prepare();
     auto handler = boost::bind( &posix_chat_client::cb_read_socket, this, asio::placeholders::error, asio::placeholders::bytes_transferred );
     m_socket.async_read_some( buffer, handler );
 }
@@ -65,13 +87,45 @@ void posix_chat_client::cb_read_socket( const boost::system::error_code& error,
         return;
     }
 
-    if( feed_to_unpacker( m_read_buffer, bytes_recv ) )
+    std::stringstream ss;
+
+    try
     {
-        std::stringstream ss;
-        ss << m_msg << std::endl;
-        std::string output = ss.str();
+        if( m_framed_in )
+        {
+            m_frames.commit( bytes_recv );
+            read_frames( ss );
+        }
+        else
+        {
+            m_reader.commit( bytes_recv );
+            read_messages( ss );
+        }
+    }
+    catch( std::bad_cast& e )
+    {
+        std::cerr << "server sent garbage, closing" << std::endl;
+        close();
+        return;
+    }
+    catch( msgpack::unpack_error& e )
+    {
+        std::cerr << "server sent malformed msgpack (" << e.what() << "), closing" << std::endl;
+        close();
+        return;
+    }
+    catch( std::length_error& e )
+    {
+        std::cerr << "server sent a bad frame, closing" << std::endl;
+        close();
+        return;
+    }
+
+    std::string output = ss.str();
 
-        // sync write out the message we just received, terminated by a newline.
+    if( ! output.empty() )
+    {
+        // sync write out the messages we just received, each terminated by a newline.
         auto buffer = asio::buffer( output.data(), output.size() );
         asio::write( m_stdout, buffer );
     }
@@ -79,6 +133,92 @@ void posix_chat_client::cb_read_socket( const boost::system::error_code& error,
     listen_on_socket(); // read more bytes
 }
 
+void posix_chat_client::read_messages( std::ostream& out )
+{
+    chat_message_view msg;
+    control_view ctl;
+    message_reader::result_t result;
+
+    while( ( result = m_reader.next( msg, ctl ) ) != message_reader::need_more )
+    {
+        if( result == message_reader::got_chat )
+        {
+            out << msg << std::endl;
+        }
+        else if( ctl.command == control_message::ping )
+        {
+            send_pong();
+        }
+        else if( ctl.command == control_message::going_away )
+        {
+            out << "server going away: " << ctl.argument << std::endl;
+        }
+        else if( ctl.command == control_message::hello )
+        {
+            // the server's reply, anything after it is framed
+            m_framed_in = ctl.argument.find( framing::feature ) != boost::string_ref::npos;
+
+            if( m_framed_in )
+            {
+                boost::string_ref rest = m_reader.take_unparsed();
+                m_frames.append( rest.data(), rest.size() );
+                read_frames( out );
+                return;
+            }
+        }
+    }
+}
+
+void posix_chat_client::read_frames( std::ostream& out )
+{
+    framing::header h;
+    boost::string_ref payload;
+
+    while( m_frames.next( h, payload ) )
+    {
+        if( h.flags )
+        {
+            compression::decompress( compression::codec_t( h.flags ), payload.data(), payload.size(),
+                                     m_inflated, framing::max_payload );
+            payload = boost::string_ref( m_inflated.data(), m_inflated.size() );
+        }
+
+        std::size_t offset = 0;
+
+        for( uint32_t i = 0; i < h.count && offset < payload.size(); ++i )
+        {
+            msgpack::unpacked unpacked;
+            msgpack::unpack( unpacked, payload.data(), payload.size(), offset );
+
+            chat_message_view msg;
+            control_view ctl;
+
+            if( message_reader::decode( unpacked.get(), msg, ctl ) == message_reader::got_chat )
+            {
+                out << "[" << m_room_names[h.room] << "] " << msg << std::endl;
+            }
+            else if( ctl.command == control_message::join )
+            {
+                m_room_names[h.room] = ctl.argument.to_string();
+                out << "joined " << ctl.argument << std::endl;
+            }
+            else if( ctl.command == control_message::leave )
+            {
+                m_room_names.erase( h.room );
+                out << "left " << ctl.argument << std::endl;
+            }
+            else if( ctl.command == control_message::ping )
+            {
+                send_pong();
+            }
+            else if( ctl.command == control_message::going_away )
+            {
+                out << "server going away: " << ctl.argument << std::endl;
+            }
+        }
+    }
+}
+
 void posix_chat_client::cb_write_socket( const boost::system::error_code& error, std::size_t length )
 {
     if( error )
@@ -88,7 +228,14 @@ void posix_chat_client::cb_write_socket( const boost::system::error_code& error,
         return;
     }
 
-    listen_on_input();
+    m_writing = false;
+    write_pending();
+
+    if( ! m_writing && m_input_waiting )
+    {
+        m_input_waiting = false;
+        listen_on_input();
+    }
 }
 
 void posix_chat_client::cb_read_input( const boost::system::error_code& error, std::size_t length )
@@ -109,56 +256,101 @@ void posix_chat_client::cb_read_input( const boost::system::error_code& error, s
 
     length = m_input_buffer.size() - 1; // ignore newline
 
-    // consume and write m_input_buffer to m_write_buffer
-    m_input_buffer.sgetn( m_write_buffer.data(), length );
-    m_input_buffer.consume( 1 ); // remove newline from input
-
-    // populate m_msg
-    std::string& m = m_msg.message;
-    m.replace( m.begin(), m.end(), m_write_buffer.data(), m_write_buffer.data() + length );
+    // populate m_msg straight from m_input_buffer, then drop the line and
+    // its newline
+    auto line = m_input_buffer.data();
+    m_msg.message.assign( asio::buffers_begin( line ), asio::buffers_begin( line ) + length );
     m_msg.nickname = m_nickname;
+    m_input_buffer.consume( length + 1 );
     //std::cout << m_msg.nickname << ": " << m_msg.message << std::endl;
 
-    // msgpack m_msg and then send it
+    // msgpack m_msg, or the /command it was, and then send it
     m_packer.clear();
-    msgpack::pack( m_packer, m_msg );
-    auto buffer = asio::buffer( m_packer.data(), m_packer.size() );
-    auto handler = boost::bind( &posix_chat_client::cb_write_socket, this, asio::placeholders::error, asio::placeholders::bytes_transferred );
-    asio::async_write( m_socket, buffer, handler );
+    control_message ctl;
+
+    if( parse_command( m_msg.message, ctl ) )
+    {
+        msgpack::pack( m_packer, ctl );
+    }
+    else
+    {
+        msgpack::pack( m_packer, m_msg );
+    }
+
+    // the next line is read once this one is on its way
+    m_input_waiting = true;
+    send( m_packer, ctl.command ? framing::control : framing::chat );
 }
 
-void posix_chat_client::close()
+// the server pings us when we've been quiet for a while, the pong queues up
+// behind whatever we're in the middle of writing
+void posix_chat_client::send_pong()
 {
-    // cancel all outstanding asynchronous operations.
-    m_socket.close();
-    m_stdin.close();
-    m_stdout.close();
+    m_packer.clear();
+    msgpack::pack( m_packer, control_message( control_message::pong, "" ) );
+
+    send( m_packer, framing::control );
 }
 
-bool posix_chat_client::feed_to_unpacker( const buffer_t& buffer, std::size_t length )
+void posix_chat_client::send( const msgpack::sbuffer& payload, framing::type_t type )
 {
-    try
+    if( m_framed_out )
+    {
+        // room 0, whichever room we're talking in
+        char header[framing::header_size];
+        framing::header h = { uint32_t( payload.size() ), 0, 1, uint8_t( type ), 0 };
+        framing::encode( h, header );
+        m_outbox.write( header, framing::header_size );
+    }
+
+    m_outbox.write( payload.data(), payload.size() );
+    write_pending();
+}
+
+void posix_chat_client::write_pending()
+{
+    if( m_writing || m_outbox.size() == 0 )
+    {
+        return;
+    }
+
+    std::swap( m_outbox, m_sending );
+    m_outbox.clear();
+    m_writing = true;
+
+    auto handler = boost::bind( &posix_chat_client::cb_write_socket, this, asio::placeholders::error, asio::placeholders::bytes_transferred );
+    asio::async_write( m_socket, asio::buffer( m_sending.data(), m_sending.size() ), handler );
+}
+
+// turns "/join room", "/leave [room]" and "/switch room" into control messages
+bool posix_chat_client::parse_command( const std::string& line, control_message& ctl )
+{
+    static const struct { const char* name; unsigned command; } commands[] =
     {
-        // feed data to unpacker, need to decode incoming bytes
-        // because we only want to send full messages
-        m_unpacker.reserve_buffer( length );
-        std::copy( buffer.data(), buffer.data() + length, m_unpacker.buffer() );
-        m_unpacker.buffer_consumed( length );
+        { "/join",   control_message::join },
+        { "/leave",  control_message::leave },
+        { "/switch", control_message::switch_room },
+    };
 
-        // maybe get object out of it
-        msgpack::unpacked result;
+    for( auto& c : commands )
+    {
+        std::size_t len = std::strlen( c.name );
 
-        if( m_unpacker.next( &result ) )
+        if( line.compare( 0, len, c.name ) == 0 && ( line.size() == len || line[len] == ' ' ) )
         {
-            result.get().convert( &m_msg );
+            ctl.command = c.command;
+            ctl.argument = line.size() > len ? line.substr( len + 1 ) : std::string();
+            return true;
         }
     }
-    catch( std::bad_cast& e )
-    {
-        std::cerr << "server sent garbage, closing" << std::endl;
-        close();
-        return false;
-    }
 
-    return true;
+    return false;
+}
+
+void posix_chat_client::close()
+{
+    // cancel all outstanding asynchronous operations.
+    m_socket.close();
+    m_stdin.close();
+    m_stdout.close();
 }
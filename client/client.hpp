@@ -2,11 +2,15 @@
 
 #include <cstdlib>
 #include <iostream>
+#include <map>
 
 #include <boost/asio.hpp>
 #include <msgpack.hpp>
 
 #include "common.hpp"
+#include "message_reader.hpp"
+#include "framing.hpp"
+#include "compression.hpp"
 
 using boost::asio::ip::tcp;
 namespace posix = boost::asio::posix;
@@ -17,7 +21,9 @@ public:
     posix_chat_client(
         boost::asio::io_service& io_service,
         tcp::resolver::iterator endpoint_iterator,
-        std::string nickname );
+        std::string nickname,
+        bool framed = false,
+        compression::codec_t codec = compression::none );
 
 private:
 
@@ -32,17 +38,39 @@ private:
 
     void close();
 
-    bool feed_to_unpacker( const buffer_t& buffer, std::size_t length );
+    void read_messages( std::ostream& out );
+    void read_frames( std::ostream& out );
+
+    bool parse_command( const std::string& line, control_message& ctl );
+    void send_pong();
+    void send( const msgpack::sbuffer& payload, framing::type_t type );
+    void write_pending();
 
     tcp::socket m_socket;
     posix::stream_descriptor m_stdin;
     posix::stream_descriptor m_stdout;
-    buffer_t m_read_buffer;
-    buffer_t m_write_buffer;
     boost::asio::streambuf m_input_buffer;
 
     std::string m_nickname;
-    msgpack::unpacker m_unpacker;
+    message_reader    m_reader;
     msgpack::sbuffer  m_packer;
     chat_message m_msg;
+
+    // what's waiting to go out (with its frame headers once we're framed)
+    // and the one write in flight. lines from the console and pongs both
+    // queue here so their writes can't interleave. the console is read
+    // again once everything queued has been written
+    msgpack::sbuffer m_outbox;
+    msgpack::sbuffer m_sending;
+    bool m_writing;
+    bool m_input_waiting;
+
+    // asked the server for framing, and whether it's agreed yet. our
+    // side switches as soon as the hello is sent, theirs after the reply
+    bool m_framed_out;
+    bool m_framed_in;
+    frame_reader m_frames;
+    compression::codec_t m_codec;       // what we ask the server for
+    std::vector<char> m_inflated;
+    std::map<uint32_t, std::string> m_room_names;
 };
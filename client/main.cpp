@@ -15,9 +15,30 @@ int main( int argc, char* argv[] )
 {
     try
     {
-        if( argc != 4 )
+        bool framed = false;
+        compression::codec_t codec = compression::none;
+        bool usage = argc < 4;
+
+        for( int i = 4; i < argc; ++i )
+        {
+            if( std::strcmp( argv[i], "--framed" ) == 0 )
+            {
+                framed = true;
+            }
+            else if( std::strncmp( argv[i], "--compress=", 11 ) == 0
+                     && ( codec = compression::from_name( argv[i] + 11 ) ) != compression::none )
+            {
+                framed = true; // compression needs framing
+            }
+            else
+            {
+                usage = true;
+            }
+        }
+
+        if( usage )
         {
-            std::cerr << "Usage: chat_client <nickname> <host> <port>\n";
+            std::cerr << "Usage: chat_client <nickname> <host> <port> [--framed] [--compress=lz4|zstd]\n";
             return 1;
         }
         
@@ -27,7 +48,7 @@ int main( int argc, char* argv[] )
         tcp::resolver::query query( argv[2], argv[3] );
         tcp::resolver::iterator iterator = resolver.resolve( query );
         
-        posix_chat_client c( io_service, iterator, argv[1] );
+        posix_chat_client c( io_service, iterator, argv[1], framed, codec );
         
         std::cout << "start typing..." << std::endl;
         io_service.run();
@@ -1,6 +1,5 @@
 #include <cstdlib>
 #include <cstring>
-#include <mutex>
 #include <thread>
 #include <iostream>
 
@@ -14,53 +13,105 @@ namespace asio = boost::asio;
 namespace posix = boost::asio::posix;
 using asio::ip::tcp;
 
-#include <boost/thread/locks.hpp>
-#include <boost/thread/lock_guard.hpp>
-std::mutex cout_mutex;
-
-bool hammer_client::keep_running = true;
+std::atomic<bool> hammer_client::keep_running( true );
 
 hammer_client::hammer_client( asio::io_service& io_service,
                               tcp::resolver::iterator endpoint_iterator,
-                              std::string nickname )
+                              unsigned index,
+                              hammer_stats& stats,
+                              const workload& work,
+                              unsigned pipeline,
+                              journal_reader* journal,
+                              double rate )
     : m_socket( io_service ),
-      m_stdin( io_service, ::dup( STDIN_FILENO ) ),
-      m_stdout( io_service, ::dup( STDOUT_FILENO ) ),
-      m_input_buffer( max_msg_length )
+      m_stats( stats ),
+      m_id( index ),
+      m_work( work ),
+      m_lurker( work.lurker( index ) ),
+      m_churner( work.churner( index ) ),
+      m_slow( work.slow_reader( index ) ),
+      m_epoch( 0 ),
+      m_churn_timer( io_service ),
+      m_read_timer( io_service ),
+      m_batched( ( rate > 0 && ! journal ) || m_lurker ),
+      m_open_loop( rate > 0 && ! journal && ! m_lurker ),
+      m_interval( rate > 0 ? std::chrono::nanoseconds( uint64_t( 1e9 / rate ) ) : std::chrono::nanoseconds( 0 ) ),
+      m_rate_timer( io_service ),
+      m_filling( 0 ),
+      m_write_in_flight( false )
 {
+    m_pipeline = pipeline;
+    m_journal = journal;
     m_sent_count = 0;
-    m_recv_count = 0;
-    m_nickname = nickname;
+    m_nickname = "hammer-" + std::to_string( index );
     m_msg.nickname = m_nickname;
 
+    std::seed_seq seed{ work.seed, index };
+    m_rng.seed( seed );
+
     // attempt to connect to server, call handle_connect when we do
     auto handler = boost::bind( &hammer_client::handle_connect, this, asio::placeholders::error );
     asio::async_connect( m_socket, endpoint_iterator, handler );
 }
 
-hammer_client::~hammer_client()
-{
-    std::lock_guard<std::mutex> lock( cout_mutex );
-    std::cout << m_nickname << " sent " << m_sent_count << std::endl;
-    std::cout << m_nickname << " recv " << (m_recv_count / 21) << std::endl;
-}
-
 void hammer_client::handle_connect( const boost::system::error_code& error )
 {
     if( error )
     {
-        std::cerr << "could not connect to " << m_socket.remote_endpoint() << std::endl;
+        std::cerr << m_nickname << " could not connect: " << error.message() << std::endl;
         return;
     }
 
     listen_on_socket();
+
+    if( m_work.rooms )
+    {
+        switch_room();
+    }
+
+    if( m_churner )
+    {
+        churn_later();
+    }
+
+    if( m_lurker )
+    {
+        return; // only here to listen
+    }
+
+    if( m_open_loop )
+    {
+        m_next_send = std::chrono::steady_clock::now();
+        send_on_schedule();
+        return;
+    }
+
     send_msg();
 }
 
 void hammer_client::listen_on_socket()
 {
-    // read from socket
-    auto buffer = asio::buffer( m_read_buffer, 1024 );
+    if( m_slow )
+    {
+        // let the server's queue for us fill up between reads
+        m_read_timer.expires_from_now( m_work.slow_delay );
+        m_read_timer.async_wait( [this]( boost::system::error_code ec )
+        {
+            if( ! ec )
+            {
+                read_socket();
+            }
+        } );
+        return;
+    }
+
+    read_socket();
+}
+
+void hammer_client::read_socket()
+{
+    // read from socket, straight into the unpacker
+    auto buffer = m_reader.prepare();
     auto handler = boost::bind( &hammer_client::cb_read_socket, this, asio::placeholders::error, asio::placeholders::bytes_transferred );
     m_socket.async_read_some( buffer, handler );
 }
@@ -74,7 +125,79 @@ void hammer_client::cb_read_socket( const boost::system::error_code& error, std:
         return;
     }
 
-    m_recv_count += bytes_recv;
+    try
+    {
+        m_reader.commit( bytes_recv );
+
+        chat_message_view msg;
+        control_view ctl;
+        message_reader::result_t result;
+        uint64_t now = hammer_timestamp();
+
+        while( ( result = m_reader.next( msg, ctl ) ) != message_reader::need_more )
+        {
+            if( result == message_reader::got_control )
+            {
+                // lurkers go quiet long enough to be pinged
+                if( ctl.command == control_message::ping )
+                {
+                    send_control( control_message::pong, "" );
+                }
+
+                continue;
+            }
+
+            m_stats.recv++;
+
+            // other hammers number their msgs and stamp them with when they
+            // sent them. a replayed journal's msgs aren't ours, nor is
+            // anything from a human in the room
+            uint64_t id, seq, epoch, sent;
+
+            if( m_journal || ! hammer_msg::parse_id( msg.nickname, id ) )
+            {
+                continue;
+            }
+
+            if( ! hammer_msg::parse( msg.message, id, seq, epoch, sent ) )
+            {
+                m_stats.delivery.corrupt++;
+                continue;
+            }
+
+            if( ! m_churner )
+            {
+                m_checker.check( id, seq, epoch, m_stats.delivery );
+            }
+
+            if( sent <= now )
+            {
+                m_stats.latency.record( now - sent );
+            }
+        }
+    }
+    catch( std::bad_cast& e )
+    {
+        m_stats.delivery.corrupt++;
+        std::cerr << "server sent garbage, closing" << std::endl;
+        close();
+        return;
+    }
+    catch( msgpack::unpack_error& e )
+    {
+        m_stats.delivery.corrupt++;
+        std::cerr << "server sent malformed msgpack (" << e.what() << "), closing" << std::endl;
+        close();
+        return;
+    }
+    catch( std::length_error& e )
+    {
+        m_stats.delivery.corrupt++;
+        std::cerr << "server sent a message over max_msg_length, closing" << std::endl;
+        close();
+        return;
+    }
+
     listen_on_socket(); // read more bytes
 }
 
@@ -87,16 +210,114 @@ void hammer_client::cb_write_socket( const boost::system::error_code& error, std
         return;
     }
 
+    if( m_batched )
+    {
+        m_write_in_flight = false;
+        write_pending();
+        return;
+    }
+
     send_msg();
 }
 
+void hammer_client::send_control( unsigned command, const std::string& argument )
+{
+    if( m_batched )
+    {
+        msgpack::pack( m_batches[m_filling], control_message( command, argument ) );
+        write_pending();
+        return;
+    }
+
+    msgpack::pack( m_control, control_message( command, argument ) );
+}
+
+// somewhere else, picked with the workload's skew. what we say from here on
+// is a new epoch, so the new room's members don't count what went to the
+// old one as lost
+void hammer_client::switch_room()
+{
+    m_epoch++;
+    send_control( control_message::switch_room, "room-" + std::to_string( m_work.pick_room( m_rng ) ) );
+}
+
+void hammer_client::churn_later()
+{
+    std::exponential_distribution<double> stay( 1.0 / std::max<int64_t>( m_work.churn_interval.count(), 1 ) );
+
+    m_churn_timer.expires_from_now( std::chrono::milliseconds( int64_t( stay( m_rng ) ) + 1 ) );
+    m_churn_timer.async_wait( [this]( boost::system::error_code ec )
+    {
+        if( ! ec && keep_running && m_socket.is_open() )
+        {
+            switch_room();
+            churn_later();
+        }
+    } );
+}
+
+void hammer_client::send_on_schedule()
+{
+    // main stops the io threads once the run is over, and a client whose
+    // socket is gone has nobody to send to
+    if( ! keep_running || ! m_socket.is_open() )
+    {
+        return;
+    }
+
+    // everything that's come due, however late we are
+    auto now = std::chrono::steady_clock::now();
+
+    while( m_next_send <= now )
+    {
+        pack_msg( m_batches[m_filling], m_next_send );
+        m_next_send += m_interval;
+    }
+
+    write_pending();
+
+    m_rate_timer.expires_at( m_next_send );
+    m_rate_timer.async_wait( [this]( boost::system::error_code ec )
+    {
+        if( ! ec )
+        {
+            send_on_schedule();
+        }
+    } );
+}
+
+void hammer_client::write_pending()
+{
+    msgpack::sbuffer& batch = m_batches[m_filling];
+
+    if( m_write_in_flight || batch.size() == 0 || ! m_socket.is_open() )
+    {
+        return;
+    }
+
+    // the other buffer's write is done, it takes the next msgs
+    m_filling ^= 1;
+    m_batches[m_filling].clear();
+    m_write_in_flight = true;
+
+    auto buffer = asio::buffer( batch.data(), batch.size() );
+    auto handler = boost::bind( &hammer_client::cb_write_socket, this, asio::placeholders::error, asio::placeholders::bytes_transferred );
+    asio::async_write( m_socket, buffer, handler );
+}
+
 typedef std::shared_ptr<boost::asio::deadline_timer> pointer_deadline_timer;
 
 void hammer_client::send_msg()
 {
-    if( ! keep_running )
+    if( ! keep_running || ! m_socket.is_open() )
+    {
+        return;
+    }
+
+    if( m_pipeline )
     {
-        m_socket.get_io_service().stop();
+        // no pacing, the next batch goes as soon as the last one is written
+        write_msgs();
         return;
     }
 
@@ -110,28 +331,100 @@ void hammer_client::send_msg()
         //std::chrono::duration<double, std::milli> t(1000);
         //std::this_thread::sleep_for(t);
 
-        std::stringstream ss;
-        ss << "msg num " << m_sent_count++;
-        std::string message = ss.str();
+        write_msgs();
+    } );
+}
+
+void hammer_client::write_msgs()
+{
+    if( ! m_socket.is_open() )
+    {
+        return;
+    }
 
-        std::copy( message.begin(), message.end(), m_write_buffer.data() );
+    if( m_journal )
+    {
+        write_journal();
+        return;
+    }
 
-        // populate m_msg
-        std::string& m = m_msg.message;
-        m.replace( m.begin(), m.end(), message.begin(), message.end() );
-        //std::cout << m_msg.nickname << ": " << m_msg.message << std::endl;
+    m_packer.clear();
 
-        // msgpack m_msg and then send it
-        m_packer.clear();
-        msgpack::pack( m_packer, m_msg );
-        auto buffer = asio::buffer( m_packer.data(), m_packer.size() );
-        auto handler = boost::bind( &hammer_client::cb_write_socket, this, asio::placeholders::error, asio::placeholders::bytes_transferred );
-        asio::async_write( m_socket, buffer, handler );
-    } );
+    if( m_control.size() )
+    {
+        m_packer.write( m_control.data(), m_control.size() );
+        m_control.clear();
+    }
+
+    // msgpack m_pipeline (or just one) messages back to back and send them
+    // with a single write
+    unsigned count = m_pipeline ? m_pipeline : 1;
+    auto now = std::chrono::steady_clock::now();
+
+    for( unsigned i = 0; i < count; ++i )
+    {
+        pack_msg( m_packer, now );
+    }
+
+    auto buffer = asio::buffer( m_packer.data(), m_packer.size() );
+    auto handler = boost::bind( &hammer_client::cb_write_socket, this, asio::placeholders::error, asio::placeholders::bytes_transferred );
+    asio::async_write( m_socket, buffer, handler );
+}
+
+// every msg carries our sequence number and when it was sent, other
+// hammers check delivery and time it with that (see verify.hpp)
+void hammer_client::pack_msg( msgpack::sbuffer& out, std::chrono::steady_clock::time_point sent )
+{
+    hammer_msg::format( m_msg.message, m_id, m_sent_count++, m_epoch, hammer_timestamp( sent ), m_work.msg_size( m_rng ) );
+    m_stats.sent++;
+
+    msgpack::pack( out, m_msg );
+}
+
+void hammer_client::write_journal()
+{
+    m_journal_bufs.clear();
+    m_packer.clear();
+
+    if( m_control.size() )
+    {
+        m_packer.write( m_control.data(), m_control.size() );
+        m_control.clear();
+        m_journal_bufs.push_back( asio::buffer( m_packer.data(), m_packer.size() ) );
+    }
+
+    unsigned count = m_pipeline ? m_pipeline : 1;
+    journal_record record;
+
+    for( unsigned i = 0; i < count; ++i )
+    {
+        if( ! m_journal->next( record ) )
+        {
+            m_journal->rewind(); // loop the journal forever
+
+            if( ! m_journal->next( record ) )
+            {
+                std::cerr << "journal has no records" << std::endl;
+                close();
+                return;
+            }
+        }
+
+        m_journal_bufs.push_back( asio::buffer( record.data.data(), record.data.size() ) );
+        m_sent_count += record.count;
+        m_stats.sent += record.count;
+    }
+
+    auto handler = boost::bind( &hammer_client::cb_write_socket, this, asio::placeholders::error, asio::placeholders::bytes_transferred );
+    asio::async_write( m_socket, m_journal_bufs, handler );
 }
 
 void hammer_client::close()
 {
-    // cancel all outstanding asynchronous operations.
+    // cancel all outstanding asynchronous operations, the timers too or
+    // they'd keep packing msgs for a socket that's gone
+    m_rate_timer.cancel();
+    m_churn_timer.cancel();
+    m_read_timer.cancel();
     m_socket.close();
 }
@@ -1,52 +1,126 @@
 #pragma once
 
+#include <atomic>
 #include <cstdlib>
 #include <iostream>
+#include <random>
 
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <msgpack.hpp>
 
 #include "common.hpp"
+#include "message_reader.hpp"
+#include "journal.hpp"
+#include "latency.hpp"
+#include "verify.hpp"
+#include "workload.hpp"
 
 using boost::asio::ip::tcp;
 namespace posix = boost::asio::posix;
 
+// what the clients on one io thread have done between them. shared rather
+// than one per client, a histogram per connection adds up fast at 100k
+// connections. only touched from that thread
+struct hammer_stats
+{
+    unsigned long       sent = 0;
+    unsigned long       recv = 0;
+    latency_histogram   latency;    // ns, send to receive
+    delivery_counts     delivery;
+
+    void merge( const hammer_stats& other )
+    {
+        sent += other.sent;
+        recv += other.recv;
+        latency.merge( other.latency );
+        delivery.merge( other.delivery );
+    }
+};
+
 class hammer_client
 {
 public:
     hammer_client(
         boost::asio::io_service& io_service,
         tcp::resolver::iterator endpoint_iterator,
-        std::string nickname );
-
-    ~hammer_client();
+        unsigned index,
+        hammer_stats& stats,
+        const workload& work,
+        unsigned pipeline = 0,
+        journal_reader* journal = nullptr,
+        double rate = 0 );
 
-    static bool keep_running;
+    static std::atomic<bool> keep_running;
 
 private:
 
     void handle_connect( const boost::system::error_code& error );
 
     void listen_on_socket();
+    void read_socket();
     void cb_read_socket( const boost::system::error_code& error, std::size_t bytes_recv );
     void cb_write_socket( const boost::system::error_code& error, std::size_t length );
 
     void close();
 
     void send_msg();
+    void write_msgs();
+    void write_journal();
+    void pack_msg( msgpack::sbuffer& out, std::chrono::steady_clock::time_point sent );
+    void send_control( unsigned command, const std::string& argument );
+
+    void switch_room();
+    void churn_later();
+
+    // open loop
+    void send_on_schedule();
+    void write_pending();
 
     tcp::socket m_socket;
-    posix::stream_descriptor m_stdin;
-    posix::stream_descriptor m_stdout;
-    buffer_t m_read_buffer;
-    buffer_t m_write_buffer;
-    boost::asio::streambuf m_input_buffer;
+    hammer_stats& m_stats;
 
     std::string m_nickname;
-    msgpack::unpacker m_unpacker;
+    uint64_t m_id;              // the n in hammer-<n>, goes into every msg's checksum
+    delivery_checker m_checker;
+
+    // what this client does, see workload.hpp
+    const workload& m_work;
+    std::mt19937_64 m_rng;
+    bool m_lurker;
+    bool m_churner;             // doesn't check delivery, it keeps missing bits of rooms
+    bool m_slow;
+    uint64_t m_epoch;           // rooms switched so far
+    boost::asio::steady_timer m_churn_timer;
+    boost::asio::steady_timer m_read_timer;
+
+    // a control (join, pong) for the server. senders waiting on each write
+    // send it in front of the next msgs, everybody else queues it in the
+    // open loop's batches
+    msgpack::sbuffer m_control;
+    bool m_batched;
+    message_reader    m_reader;
     msgpack::sbuffer  m_packer;
     chat_message m_msg;
 
-    unsigned long m_sent_count;
-    unsigned long m_recv_count;
+    unsigned m_pipeline; // 0 == one msg per ms, otherwise msgs per write, back to back
+
+    // replay a room journal's frames, straight out of the mapping, instead
+    // of making up messages. m_pipeline then counts frames not msgs
+    journal_reader* m_journal;
+    std::vector<boost::asio::const_buffer> m_journal_bufs;
+    unsigned long m_sent_count;     // and the next msg's sequence number
+
+    // open loop, a rate (msgs/sec) instead of waiting on each write. msgs
+    // are stamped with when the schedule said they should go, not when they
+    // do, so a server that stalls us shows up as latency rather than as
+    // fewer samples. whatever comes due while a write is in flight piles up
+    // in the other buffer and goes out next
+    bool m_open_loop;
+    std::chrono::nanoseconds m_interval;
+    std::chrono::steady_clock::time_point m_next_send;
+    boost::asio::steady_timer m_rate_timer;
+    msgpack::sbuffer m_batches[2];
+    unsigned m_filling;         // the batch msgs are being added to
+    bool m_write_in_flight;
 };
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// a log-linear histogram in the spirit of HdrHistogram: every power of two
+// is split into sub_buckets linear buckets, so any recorded value is known
+// to within 1 / sub_buckets (under 1%) however big it is. fixed size, recording
+// never allocates
+class latency_histogram
+{
+public:
+    enum { sub_bits = 7, sub_buckets = 1 << sub_bits, num_buckets = ( 64 - sub_bits + 1 ) * sub_buckets };
+
+    latency_histogram()
+        : m_buckets( num_buckets, 0 ),
+          m_count( 0 ),
+          m_max( 0 )
+    {
+    }
+
+    void record( uint64_t value )
+    {
+        m_buckets[index( value )]++;
+        m_count++;
+        m_max = std::max( m_max, value );
+    }
+
+    void merge( const latency_histogram& other )
+    {
+        for( std::size_t i = 0; i < num_buckets; ++i )
+        {
+            m_buckets[i] += other.m_buckets[i];
+        }
+
+        m_count += other.m_count;
+        m_max = std::max( m_max, other.m_max );
+    }
+
+    // the value below which fraction p (0..1) of the recordings fall, as
+    // the top of its bucket
+    uint64_t percentile( double p ) const
+    {
+        uint64_t wanted = uint64_t( p * m_count + 0.5 );
+        uint64_t seen = 0;
+
+        for( std::size_t i = 0; i < num_buckets; ++i )
+        {
+            seen += m_buckets[i];
+
+            if( seen >= wanted && seen > 0 )
+            {
+                return std::min( highest( i ), m_max );
+            }
+        }
+
+        return m_max;
+    }
+
+    uint64_t count() const { return m_count; }
+    uint64_t max() const { return m_max; }
+
+private:
+    static std::size_t index( uint64_t value )
+    {
+        if( value < sub_buckets )
+        {
+            return value;
+        }
+
+        unsigned exponent = 63 - __builtin_clzll( value );
+        unsigned shift = exponent - sub_bits;
+        return ( ( shift + 1 ) << sub_bits ) + ( ( value >> shift ) & ( sub_buckets - 1 ) );
+    }
+
+    // the biggest value that lands in bucket i
+    static uint64_t highest( std::size_t i )
+    {
+        if( i < sub_buckets )
+        {
+            return i;
+        }
+
+        unsigned shift = unsigned( i >> sub_bits ) - 1;
+        uint64_t low = ( uint64_t( sub_buckets ) + ( i & ( sub_buckets - 1 ) ) ) << shift;
+        return low + ( uint64_t( 1 ) << shift ) - 1;
+    }
+
+    std::vector<uint64_t>   m_buckets;
+    uint64_t                m_count;
+    uint64_t                m_max;
+};
+
+// what goes in a hammer message to time it, nanoseconds on the steady clock.
+// only comparable between processes on the same host
+inline uint64_t hammer_timestamp( std::chrono::steady_clock::time_point t )
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>( t.time_since_epoch() ).count();
+}
+
+inline uint64_t hammer_timestamp()
+{
+    return hammer_timestamp( std::chrono::steady_clock::now() );
+}
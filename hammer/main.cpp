@@ -1,16 +1,21 @@
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
-#include <sstream>
 #include <thread>
-#include <future>
 #include <chrono>
 #include <vector>
+#include <memory>
 #include <algorithm>
+#include <functional>
+
+#include <sys/resource.h>
 
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/program_options.hpp>
 using boost::asio::ip::tcp;
 namespace posix = boost::asio::posix;
+namespace po = boost::program_options;
 using std::cout;
 using std::cerr;
 using std::endl;
@@ -19,49 +24,328 @@ using std::endl;
 #include "client.hpp"
 #include "signals.hpp"
 
-int main( int argc, char* argv[] )
+bool parse_cmd_line( int argc, char** argv, po::variables_map& opts )
 {
+    po::options_description desc( "hammer options" );
+
+    desc.add_options()
+    ( "help,h", "show help" )
+    ( "clients", po::value<unsigned>()->required(), "number of concurrent clients" )
+    ( "host", po::value<std::string>()->required(), "server to hammer" )
+    ( "port", po::value<std::string>()->required(), "port to hammer" )
+    ( "pipeline", po::value<unsigned>()->default_value( 0 ), "send this many msgs per write, back to back, instead of one per ms" )
+    ( "journal", po::value<std::string>(), "replay a server room journal instead of generated msgs" )
+    ( "duration", po::value<unsigned>()->default_value( 0 ), "stop after this many seconds, 0 runs until ctrl-c" )
+    ( "rate", po::value<double>()->default_value( 0 ), "open loop, send this many msgs/sec over all clients whatever the server does. 0 waits on each write instead" )
+    ( "threads,t", po::value<unsigned>()->default_value( 0 ), "io threads to spread the clients over, 0 for one per core" )
+    ( "ramp", po::value<double>()->default_value( 0 ), "connect this many clients a second, 0 connects them all at once" )
+    ( "rooms", po::value<unsigned>()->default_value( 0 ), "spread the clients over this many rooms, 0 leaves them all in the lobby" )
+    ( "room-skew", po::value<double>()->default_value( 0 ), "zipf exponent for picking rooms, 0 fills them evenly, 1 and up makes a few big rooms and a long tail" )
+    ( "msg-size", po::value<std::string>()->default_value( "0" ), "msg size in bytes: <n>, uniform:<min>:<max> or lognormal:<median>:<sigma>" )
+    ( "lurkers", po::value<double>()->default_value( 0 ), "fraction of clients that never send" )
+    ( "churn", po::value<double>()->default_value( 0 ), "fraction of clients that keep switching rooms" )
+    ( "churn-ms", po::value<unsigned>()->default_value( 5000 ), "mean time a churning client stays in a room" )
+    ( "slow", po::value<double>()->default_value( 0 ), "fraction of clients that read slowly" )
+    ( "slow-ms", po::value<unsigned>()->default_value( 100 ), "how long a slow client waits before each read" )
+    ( "seed", po::value<unsigned>()->default_value( 1 ), "seed for everything random, the same seed gives the same workload" )
+    ( "json", "print the summary as a json object rather than a summary: line" )
+    ;
+
+    po::positional_options_description pd;
+    pd.add( "clients", 1 ).add( "host", 1 ).add( "port", 1 ).add( "pipeline", 1 ).add( "journal", 1 );
+
     try
     {
-        if( argc != 4 )
+        po::store( po::command_line_parser( argc, argv ).options( desc ).positional( pd ).run(), opts );
+
+        if( opts.count( "help" ) )
         {
-            std::cerr << "Usage: chat_client <num_concurrent> <host> <port>\n";
-            return 1;
+            cout << "usage: hammer [options] <clients> <host> <port> [pipeline] [journal]" << endl;
+            cout << desc << endl;
+            exit( 0 );
         }
 
+        po::notify( opts );
+    }
+    catch( std::exception& e )
+    {
+        cerr << e.what() << endl;
+        cerr << "usage: hammer [options] <clients> <host> <port> [pipeline] [journal]" << endl;
+        cerr << desc << endl;
+        return false;
+    }
+
+    return true;
+}
+
+// one line a script can pick apart, latencies in microseconds
+void print_summary( const hammer_stats& t, double seconds )
+{
+    cout << "summary:"
+         << " seconds=" << seconds
+         << " sent=" << t.sent
+         << " recv=" << t.recv
+         << " sent_per_sec=" << uint64_t( t.sent / seconds )
+         << " recv_per_sec=" << uint64_t( t.recv / seconds )
+         << " p50_us=" << t.latency.percentile( 0.5 ) / 1000
+         << " p99_us=" << t.latency.percentile( 0.99 ) / 1000
+         << " p999_us=" << t.latency.percentile( 0.999 ) / 1000
+         << " max_us=" << t.latency.max() / 1000
+         << " samples=" << t.latency.count()
+         << " lost=" << t.delivery.lost
+         << " duplicated=" << t.delivery.duplicated
+         << " reordered=" << t.delivery.reordered
+         << " corrupt=" << t.delivery.corrupt
+         << endl;
+}
+
+void print_json( const hammer_stats& t, double seconds )
+{
+    cout << "{"
+         << "\"seconds\": " << seconds
+         << ", \"sent\": " << t.sent
+         << ", \"recv\": " << t.recv
+         << ", \"sent_per_sec\": " << uint64_t( t.sent / seconds )
+         << ", \"recv_per_sec\": " << uint64_t( t.recv / seconds )
+         << ", \"latency_us\": {"
+         << "\"p50\": " << t.latency.percentile( 0.5 ) / 1000
+         << ", \"p99\": " << t.latency.percentile( 0.99 ) / 1000
+         << ", \"p999\": " << t.latency.percentile( 0.999 ) / 1000
+         << ", \"max\": " << t.latency.max() / 1000
+         << ", \"samples\": " << t.latency.count()
+         << "}, \"delivery\": {"
+         << "\"lost\": " << t.delivery.lost
+         << ", \"duplicated\": " << t.delivery.duplicated
+         << ", \"reordered\": " << t.delivery.reordered
+         << ", \"corrupt\": " << t.delivery.corrupt
+         << "}}" << endl;
+}
+
+// a big run needs a descriptor per connection, take all we're allowed
+void raise_fd_limit( unsigned wanted )
+{
+    rlimit limit;
+
+    if( getrlimit( RLIMIT_NOFILE, &limit ) == 0 && limit.rlim_cur < limit.rlim_max )
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit( RLIMIT_NOFILE, &limit );
+    }
+
+    if( getrlimit( RLIMIT_NOFILE, &limit ) == 0 && limit.rlim_cur < wanted + 64 )
+    {
+        cerr << "only " << limit.rlim_cur << " file descriptors allowed, some connections will fail" << endl;
+    }
+}
+
+// one io_service per thread and the clients that live on it. clients are
+// created, run and (after the thread is joined) destroyed on their own
+// thread's io_service, nothing here is shared between threads
+struct hammer_thread
+{
+    boost::asio::io_service io_service;
+    std::unique_ptr<boost::asio::io_service::work> work;
+    hammer_stats stats;
+    std::vector<std::unique_ptr<journal_reader>> journals;
+    std::vector<std::unique_ptr<hammer_client>> clients;
+    std::thread thread;
+};
+
+int main( int argc, char* argv[] )
+{
+    po::variables_map opts;
+
+    if( ! parse_cmd_line( argc, argv, opts ) )
+    {
+        return 1;
+    }
+
+    try
+    {
         boost::asio::io_service ios;
         SignalHandler signals( ios );
 
-        unsigned num_concurrent = std::atoi( argv[1] );
-        cout << "starting " << num_concurrent << " clients" << endl;
+        unsigned num_concurrent = opts["clients"].as<unsigned>();
+        unsigned pipeline = opts["pipeline"].as<unsigned>();
+        std::string host = opts["host"].as<std::string>();
+        std::string port = opts["port"].as<std::string>();
+        std::string journal_path = opts.count( "journal" ) ? opts["journal"].as<std::string>() : "";
+        unsigned duration = opts["duration"].as<unsigned>();
+        double ramp = opts["ramp"].as<double>();
+        unsigned num_threads = opts["threads"].as<unsigned>();
+
+        workload work;
+        work.rooms = opts["rooms"].as<unsigned>();
+        work.room_skew = opts["room-skew"].as<double>();
+        work.msg_size = size_dist( opts["msg-size"].as<std::string>() );
+        work.lurkers = opts["lurkers"].as<double>();
+        work.churn = opts["churn"].as<double>();
+        work.churn_interval = std::chrono::milliseconds( opts["churn-ms"].as<unsigned>() );
+        work.slow = opts["slow"].as<double>();
+        work.slow_delay = std::chrono::milliseconds( opts["slow-ms"].as<unsigned>() );
+        work.seed = opts["seed"].as<unsigned>();
+        work.prepare();
+
+        // the aggregate rate is split over whoever actually sends
+        unsigned senders = work.senders( num_concurrent );
+        double rate = senders ? opts["rate"].as<double>() / senders : 0;
+
+        if( num_threads == 0 )
+        {
+            num_threads = std::max( 1u, std::thread::hardware_concurrency() );
+        }
+
+        raise_fd_limit( num_concurrent );
+
+        // with --json stdout is just the result
+        std::ostream& log = opts.count( "json" ) ? cerr : cout;
+
+        log << "starting " << num_concurrent << " clients (" << senders << " sending) on " << num_threads << " threads";
+
+        if( work.rooms )
+        {
+            log << " in " << work.rooms << " rooms";
+        }
+
+        log << endl;
+
+        if( rate > 0 )
+        {
+            log << "open loop at " << rate << " msgs/sec per sender" << endl;
+
+            if( ! journal_path.empty() )
+            {
+                cerr << "--rate doesn't apply to journal replay, ignoring it" << endl;
+            }
+        }
+
+        tcp::resolver resolver( ios );
+        tcp::resolver::iterator endpoints = resolver.resolve( tcp::resolver::query( host, port ) );
+
+        std::vector<std::unique_ptr<hammer_thread>> threads;
+
+        for( unsigned t = 0; t < num_threads; ++t )
+        {
+            threads.emplace_back( new hammer_thread() );
+            hammer_thread& ht = *threads.back();
+            ht.work.reset( new boost::asio::io_service::work( ht.io_service ) );
+            ht.thread = std::thread( [&ht]()
+            {
+                // the clients catch what they expect. anything else that
+                // gets out stalls the client it came from, not the whole run
+                for( ;; )
+                {
+                    try
+                    {
+                        ht.io_service.run();
+                        break;
+                    }
+                    catch( std::exception& e )
+                    {
+                        cerr << "hammer thread: " << e.what() << ", carrying on" << endl;
+                    }
+                }
+            } );
+        }
+
+        // client i goes to thread i % num_threads, it's made on that thread
+        auto launch = [&]( unsigned i )
+        {
+            hammer_thread& ht = *threads[i % num_threads];
+
+            ht.io_service.post( [&ht, i, &journal_path, &work, endpoints, pipeline, rate]()
+            {
+                journal_reader* journal = nullptr;
+
+                if( ! journal_path.empty() )
+                {
+                    // every client gets its own cursor over the journal, the
+                    // page cache is shared so the mapping costs nothing extra
+                    ht.journals.emplace_back( new journal_reader( journal_path ) );
+                    journal = ht.journals.back().get();
+                }
+
+                ht.clients.emplace_back( new hammer_client( ht.io_service, endpoints, i, ht.stats, work, pipeline, journal, rate ) );
+            } );
+        };
 
-        std::vector<std::future<void>> futures;
+        // connect everybody at once, or ramp up at so many a second so the
+        // server's accept backlog (and the hammer) can keep up
+        unsigned launched = 0;
+        boost::asio::steady_timer ramp_timer( ios );
+        auto ramp_start = std::chrono::steady_clock::now();
+        std::function<void()> ramp_up;
 
-        for( int i = 0; i < num_concurrent; ++i )
+        ramp_up = [&]()
         {
-            auto future = std::async( std::launch::async, [i, &argv]()
+            std::chrono::duration<double> since = std::chrono::steady_clock::now() - ramp_start;
+            unsigned due = ramp > 0 ? std::min<unsigned>( num_concurrent, unsigned( since.count() * ramp ) + 1 ) : num_concurrent;
+
+            while( launched < due )
             {
-                boost::asio::io_service io_service;
+                launch( launched++ );
+            }
 
-                tcp::resolver resolver( io_service );
-                tcp::resolver::query query( argv[2], argv[3] );
-                tcp::resolver::iterator iterator = resolver.resolve( query );
+            if( launched < num_concurrent )
+            {
+                ramp_timer.expires_from_now( std::chrono::milliseconds( 10 ) );
+                ramp_timer.async_wait( [&]( boost::system::error_code ec )
+                {
+                    if( ! ec )
+                    {
+                        ramp_up();
+                    }
+                } );
+            }
+            else if( ramp > 0 )
+            {
+                log << "all " << num_concurrent << " clients started" << endl;
+            }
+        };
 
-                std::stringstream ss;
-                ss << "hammer-" << i;
+        ramp_up();
 
-                hammer_client c( io_service, iterator, ss.str() );
-                io_service.run();
+        boost::asio::deadline_timer timer( ios );
+
+        if( duration )
+        {
+            timer.expires_from_now( boost::posix_time::seconds( duration ) );
+            timer.async_wait( [&ios]( boost::system::error_code ec )
+            {
+                if( ! ec )
+                {
+                    hammer_client::keep_running = false;
+                    ios.stop();
+                }
             } );
-            futures.push_back( std::move( future ) );
         }
 
+        auto start = std::chrono::steady_clock::now();
+
         ios.run();
 
-        std::for_each( futures.begin(), futures.end(), []( std::future<void>& f )
+        hammer_client::keep_running = false;
+        hammer_stats total;
+
+        for( auto& ht : threads )
+        {
+            ht->work.reset();
+            ht->io_service.stop();
+            ht->thread.join();
+            ht->clients.clear();
+            total.merge( ht->stats );
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        if( opts.count( "json" ) )
         {
-            f.wait();
-        } );
+            print_json( total, elapsed.count() );
+        }
+        else
+        {
+            print_summary( total, elapsed.count() );
+        }
     }
     catch( std::exception& e )
     {
@@ -0,0 +1,122 @@
+#!/bin/sh
+# run each scenario against a server started just for it and print a json
+# array, one object per scenario with the hammer's throughput, latency and
+# delivery counts plus the server's cpu and memory, so builds can be
+# compared on the same matrix.
+#
+#   usage: ./scenarios.sh [scenario files...] > results.json
+#
+# run from hammer/ after building server and hammer, with no arguments it
+# runs everything in scenarios/. a scenario is a shell fragment setting any
+# of these (defaults shown):
+#
+#   clients=100         connections
+#   duration=10         seconds
+#   threads=0           hammer io threads, 0 for one per core
+#   rate=0              aggregate msgs/sec, 0 waits on each write instead
+#   pipeline=0          msgs per write when waiting on each write
+#   ramp=0              connects per second, 0 connects everybody at once
+#   rooms=0             0 leaves everybody in the lobby
+#   room_skew=0         zipf exponent over the rooms
+#   msg_size=0          <n>, uniform:<min>:<max> or lognormal:<median>:<sigma>
+#   lurkers=0           fraction that never send
+#   churn=0             fraction that keep switching rooms
+#   churn_ms=5000       mean time a churning client stays in a room
+#   slow=0              fraction that read slowly
+#   slow_ms=100         how long a slow client waits before each read
+#   seed=1              same seed, same workload
+#   server_args=        extra server flags
+#
+# SERVER, PORT and SERVER_ARGS (added to every scenario's server_args) can
+# be set in the environment as for tradeoff.sh
+
+PORT=${PORT:-7777}
+SERVER=${SERVER:-../server/server}
+CLK_TCK=$(getconf CLK_TCK)
+
+BUILD=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+git diff --quiet HEAD -- .. 2>/dev/null || BUILD="$BUILD-dirty"
+
+cpu_ticks()
+{
+    awk '{ print $14 + $15 }' /proc/$1/stat
+}
+
+status_kb()
+{
+    awk -v key="$2:" '$1 == key { print $2 }' /proc/$1/status
+}
+
+json_string()
+{
+    printf '"%s"' "$(printf '%s' "$1" | sed 's/\\/\\\\/g; s/"/\\"/g')"
+}
+
+run_scenario()
+{
+    clients=100 duration=10 threads=0 rate=0 pipeline=0 ramp=0
+    rooms=0 room_skew=0 msg_size=0 lurkers=0 churn=0 churn_ms=5000
+    slow=0 slow_ms=100 seed=1 server_args=
+
+    case "$1" in
+        */*) . "$1" ;;
+        *) . "./$1" ;;
+    esac
+
+    name=$(basename "$1" .scenario)
+    echo "$name: $clients clients for ${duration}s" >&2
+
+    $SERVER $server_args $SERVER_ARGS $PORT > /dev/null 2>&1 &
+    server_pid=$!
+    sleep 1
+
+    if ! kill -0 $server_pid 2>/dev/null
+    then
+        echo "$name: server didn't start" >&2
+        printf '{"scenario": %s, "build": %s, "error": "server did not start"}\n' "$(json_string "$name")" "$(json_string "$BUILD")"
+        return
+    fi
+
+    cpu_before=$(cpu_ticks $server_pid)
+    start=$(date +%s.%N)
+
+    result=$(./hammer --json --duration $duration --threads $threads --rate $rate --ramp $ramp \
+        --rooms $rooms --room-skew $room_skew --msg-size $msg_size --lurkers $lurkers \
+        --churn $churn --churn-ms $churn_ms --slow $slow --slow-ms $slow_ms --seed $seed \
+        $clients localhost $PORT $pipeline 2>/dev/null | tail -n 1)
+
+    end=$(date +%s.%N)
+    cpu_after=$(cpu_ticks $server_pid)
+    rss=$(status_kb $server_pid VmRSS)
+    peak_rss=$(status_kb $server_pid VmHWM)
+
+    kill $server_pid
+    wait $server_pid 2>/dev/null
+
+    [ -n "$result" ] || result=null
+
+    server=$(awk -v ticks=$((cpu_after - cpu_before)) -v hz=$CLK_TCK -v wall=$(echo "$end $start" | awk '{ print $1 - $2 }') \
+        -v rss=${rss:-0} -v peak=${peak_rss:-0} \
+        'BEGIN { printf "{\"cpu_seconds\": %.2f, \"cpu_percent\": %.1f, \"rss_kb\": %d, \"peak_rss_kb\": %d}", ticks / hz, ( wall > 0 ? 100 * ticks / hz / wall : 0 ), rss, peak }')
+
+    printf '{"scenario": %s, "build": %s, ' "$(json_string "$name")" "$(json_string "$BUILD")"
+    printf '"workload": {"clients": %s, "duration": %s, "rate": %s, "pipeline": %s, "rooms": %s, "room_skew": %s, ' \
+        $clients $duration $rate $pipeline $rooms $room_skew
+    printf '"msg_size": %s, "lurkers": %s, "churn": %s, "churn_ms": %s, "slow": %s, "slow_ms": %s, "seed": %s, "server_args": %s}, ' \
+        "$(json_string "$msg_size")" $lurkers $churn $churn_ms $slow $slow_ms $seed "$(json_string "$(echo $server_args $SERVER_ARGS)")"
+    printf '"hammer": %s, "server": %s}\n' "$result" "$server"
+}
+
+[ $# -gt 0 ] || set -- scenarios/*.scenario
+
+echo "["
+first=1
+
+for scenario in "$@"
+do
+    [ $first = 1 ] || echo ","
+    first=0
+    ( run_scenario "$scenario" )
+done
+
+echo "]"
@@ -0,0 +1,31 @@
+#!/bin/sh
+# sweep the server's write coalescing window and print one csv row per
+# setting, to see what batching buys in throughput and costs in latency.
+#
+#   usage: ./tradeoff.sh [clients] [seconds] [windows...]
+#
+# run from hammer/ after building server and hammer. extra server flags can
+# go in SERVER_ARGS, e.g. SERVER_ARGS="--threads 4 --tcp-cork"
+
+CLIENTS=${1:-50}
+SECONDS_PER_RUN=${2:-10}
+[ $# -gt 2 ] && shift 2 || shift $#
+WINDOWS=${*:-0 50 100 250 500 1000 2000}
+PORT=${PORT:-7777}
+SERVER=${SERVER:-../server/server}
+
+echo "coalesce_us,sent_per_sec,recv_per_sec,p50_us,p99_us,p999_us,max_us"
+
+for window in $WINDOWS
+do
+    $SERVER --tcp-nodelay --coalesce-us $window $SERVER_ARGS $PORT > /dev/null 2>&1 &
+    server_pid=$!
+    sleep 1
+
+    ./hammer --duration $SECONDS_PER_RUN $CLIENTS localhost $PORT \
+        | sed -n 's/^summary:.*sent_per_sec=\([0-9]*\) recv_per_sec=\([0-9]*\) p50_us=\([0-9]*\) p99_us=\([0-9]*\) p999_us=\([0-9]*\) max_us=\([0-9]*\).*/\1,\2,\3,\4,\5,\6/p' \
+        | sed "s/^/$window,/"
+
+    kill $server_pid
+    wait $server_pid 2>/dev/null
+done
@@ -0,0 +1,270 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+#include <boost/utility/string_ref.hpp>
+
+// what every hammer msg says, so the hammers receiving it can check what
+// the server did with it:
+//
+//     seq=<n> e=<epoch> t=<ns> sum=<checksum>[ <padding>]
+//
+// from nickname hammer-<id>. seq counts up from 0 per sender, epoch goes up
+// every time the sender switches rooms (so a receiver in the new room starts
+// following it afresh), t is when it was (meant to be) sent and the padding
+// makes up the workload's msg size. sum is 16 hex digits covering id, seq,
+// epoch, t and the msg's length, so a mangled or truncated msg can't pass
+// for a good one. all by hand straight into and out of the buffers, nothing
+// is allocated per msg
+namespace hammer_msg
+{
+    inline uint64_t checksum( uint64_t id, uint64_t seq, uint64_t epoch, uint64_t t, uint64_t length )
+    {
+        uint64_t h = id;
+
+        for( uint64_t v : { seq, epoch, t, length } )
+        {
+            h = ( h ^ v ) * 0x9E3779B97F4A7C15ull;
+            h ^= h >> 32;
+        }
+
+        return h;
+    }
+
+    inline void append_u64( std::string& out, uint64_t value )
+    {
+        char digits[20];
+        int n = 0;
+
+        do
+        {
+            digits[n++] = char( '0' + value % 10 );
+            value /= 10;
+        }
+        while( value );
+
+        while( n )
+        {
+            out.push_back( digits[--n] );
+        }
+    }
+
+    // into out, padded out to size bytes if that's more than the fields take
+    inline void format( std::string& out, uint64_t id, uint64_t seq, uint64_t epoch, uint64_t t, std::size_t size = 0 )
+    {
+        out.clear();
+        out += "seq=";
+        append_u64( out, seq );
+        out += " e=";
+        append_u64( out, epoch );
+        out += " t=";
+        append_u64( out, t );
+        out += " sum=";
+
+        std::size_t sum_at = out.size();
+        out.append( 16, '0' );
+
+        if( size > out.size() + 1 )
+        {
+            out.push_back( ' ' );
+            out.append( size - out.size(), '.' );
+        }
+
+        uint64_t sum = checksum( id, seq, epoch, t, out.size() );
+
+        for( int i = 15; i >= 0; --i, sum >>= 4 )
+        {
+            out[sum_at + i] = "0123456789abcdef"[sum & 15];
+        }
+    }
+
+    // the number at p, moving p past it. false if there isn't one
+    inline bool parse_u64( const char*& p, const char* end, uint64_t& value )
+    {
+        const char* start = p;
+        value = 0;
+
+        while( p != end && *p >= '0' && *p <= '9' && p - start < 20 )
+        {
+            value = value * 10 + uint64_t( *p++ - '0' );
+        }
+
+        return p != start;
+    }
+
+    inline bool parse_sum( const char*& p, const char* end, uint64_t& value )
+    {
+        if( end - p < 16 )
+        {
+            return false;
+        }
+
+        value = 0;
+
+        for( const char* stop = p + 16; p != stop; ++p )
+        {
+            char c = *p;
+            unsigned digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : 16;
+
+            if( digit == 16 )
+            {
+                return false;
+            }
+
+            value = value << 4 | digit;
+        }
+
+        return true;
+    }
+
+    inline bool skip( const char*& p, const char* end, const char* literal )
+    {
+        std::size_t len = std::strlen( literal );
+
+        if( std::size_t( end - p ) < len || std::memcmp( p, literal, len ) != 0 )
+        {
+            return false;
+        }
+
+        p += len;
+        return true;
+    }
+
+    // false if the msg isn't from a hammer
+    inline bool parse_id( boost::string_ref nickname, uint64_t& id )
+    {
+        const char* p = nickname.data();
+        const char* end = p + nickname.size();
+
+        return skip( p, end, "hammer-" ) && parse_u64( p, end, id ) && p == end;
+    }
+
+    // false if it's been mangled
+    inline bool parse( boost::string_ref message, uint64_t id, uint64_t& seq, uint64_t& epoch, uint64_t& t )
+    {
+        const char* p = message.data();
+        const char* end = p + message.size();
+        uint64_t sum;
+
+        return skip( p, end, "seq=" ) && parse_u64( p, end, seq )
+               && skip( p, end, " e=" ) && parse_u64( p, end, epoch )
+               && skip( p, end, " t=" ) && parse_u64( p, end, t )
+               && skip( p, end, " sum=" ) && parse_sum( p, end, sum )
+               && ( p == end || *p == ' ' )
+               && sum == checksum( id, seq, epoch, t, message.size() );
+    }
+}
+
+// what went wrong with delivery, as seen by the receivers
+struct delivery_counts
+{
+    unsigned long lost = 0;         // skipped over and never turned up
+    unsigned long duplicated = 0;
+    unsigned long reordered = 0;    // turned up after a later one
+    unsigned long corrupt = 0;      // didn't parse or failed its checksum
+
+    void merge( const delivery_counts& other )
+    {
+        lost += other.lost;
+        duplicated += other.duplicated;
+        reordered += other.reordered;
+        corrupt += other.corrupt;
+    }
+};
+
+// one receiver's view of every sender's sequence. a gap counts as lost
+// straight away, if the missing msgs turn up later (within window of the
+// newest) they're moved over to reordered. older than that we can't tell
+// a late msg from a duplicate, it's counted as reordered. a sender's new
+// epoch starts over, whatever seq it's got to
+class delivery_checker
+{
+public:
+    enum { window = 256 };
+
+    void check( uint64_t id, uint64_t seq, uint64_t epoch, delivery_counts& counts )
+    {
+        sender& s = m_senders[id];
+
+        if( s.started && epoch < s.epoch )
+        {
+            counts.reordered++;
+            return;
+        }
+
+        if( ! s.started || epoch > s.epoch )
+        {
+            // joined mid stream, got the room's scrollback first or the
+            // sender has just moved in
+            s.started = true;
+            s.epoch = epoch;
+            s.first = seq;
+            s.next = seq;
+            std::memset( s.bits, 0, sizeof( s.bits ) );
+            s.advance( seq );
+            return;
+        }
+
+        if( seq >= s.next )
+        {
+            counts.lost += seq - s.next;
+            s.advance( seq );
+            return;
+        }
+
+        if( seq < s.first || s.next - seq > window )
+        {
+            counts.reordered++;
+            return;
+        }
+
+        if( s.seen( seq ) )
+        {
+            counts.duplicated++;
+            return;
+        }
+
+        s.mark( seq );
+        counts.lost--;
+        counts.reordered++;
+    }
+
+private:
+    struct sender
+    {
+        bool        started = false;
+        uint64_t    epoch = 0;
+        uint64_t    first = 0;
+        uint64_t    next = 0;
+        uint64_t    bits[window / 64] = {}; // which of the window seqs before next arrived
+
+        bool seen( uint64_t seq ) const { return bits[( seq % window ) / 64] >> ( seq % 64 ) & 1; }
+        void mark( uint64_t seq ) { bits[( seq % window ) / 64] |= uint64_t( 1 ) << ( seq % 64 ); }
+        void unmark( uint64_t seq ) { bits[( seq % window ) / 64] &= ~( uint64_t( 1 ) << ( seq % 64 ) ); }
+
+        // move next past seq. next..seq take over the slots of the seqs
+        // that fall out of the window, clear them first
+        void advance( uint64_t seq )
+        {
+            if( seq - next >= window )
+            {
+                std::memset( bits, 0, sizeof( bits ) );
+            }
+            else
+            {
+                for( uint64_t s = next; s <= seq; ++s )
+                {
+                    unmark( s );
+                }
+            }
+
+            mark( seq );
+            next = seq + 1;
+        }
+    };
+
+    std::unordered_map<uint64_t, sender> m_senders;
+};
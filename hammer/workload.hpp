@@ -0,0 +1,151 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+
+// how big the msgs are:
+//
+//     <n>                          always n bytes
+//     uniform:<min>:<max>          anywhere in between
+//     lognormal:<median>:<sigma>   mostly small with a long tail, like chat
+//
+// 0 (the default) sends just the fields verify.hpp needs
+class size_dist
+{
+public:
+    explicit size_dist( const std::string& spec = "0" )
+        : m_kind( fixed ), m_a( 0 ), m_b( 0 )
+    {
+        std::vector<std::string> parts;
+        std::size_t begin = 0;
+
+        while( begin <= spec.size() )
+        {
+            std::size_t end = std::min( spec.find( ':', begin ), spec.size() );
+            parts.push_back( spec.substr( begin, end - begin ) );
+            begin = end + 1;
+        }
+
+        try
+        {
+            if( parts.size() == 1 )
+            {
+                m_a = std::stod( parts[0] );
+            }
+            else if( parts.size() == 3 && ( parts[0] == "uniform" || parts[0] == "lognormal" ) )
+            {
+                m_kind = parts[0] == "uniform" ? uniform : lognormal;
+                m_a = std::stod( parts[1] );
+                m_b = std::stod( parts[2] );
+            }
+            else
+            {
+                throw std::invalid_argument( spec );
+            }
+        }
+        catch( std::logic_error& )
+        {
+            throw std::invalid_argument( "bad msg size: " + spec );
+        }
+
+        if( m_a < 0 || m_b < 0 || ( m_kind == uniform && m_b < m_a ) )
+        {
+            throw std::invalid_argument( "bad msg size: " + spec );
+        }
+    }
+
+    template<typename Rng>
+    std::size_t operator()( Rng& rng ) const
+    {
+        double size = m_a;
+
+        if( m_kind == uniform )
+        {
+            size = std::uniform_real_distribution<double>( m_a, m_b )( rng );
+        }
+        else if( m_kind == lognormal )
+        {
+            size = std::lognormal_distribution<double>( std::log( std::max( m_a, 1.0 ) ), m_b )( rng );
+        }
+
+        // leave room for the nickname and msgpack's framing
+        return std::min<std::size_t>( std::size_t( size ), max_msg_length - 256 );
+    }
+
+private:
+    enum kind_t { fixed, uniform, lognormal };
+
+    kind_t  m_kind;
+    double  m_a;
+    double  m_b;
+};
+
+// what the clients do besides send. everything random comes from seed and
+// the client's index, the same workload and seed give the same run
+struct workload
+{
+    unsigned    rooms = 0;          // 0 leaves everybody in the lobby
+    double      room_skew = 0;      // zipf exponent over the rooms, 0 fills them evenly
+    size_dist   msg_size;
+    double      lurkers = 0;        // fraction that only listen
+    double      churn = 0;          // fraction that keep switching rooms
+    std::chrono::milliseconds churn_interval{ 5000 };   // mean time in a room
+    double      slow = 0;           // fraction that read slowly
+    std::chrono::milliseconds slow_delay{ 100 };        // before each read
+    unsigned    seed = 1;
+
+    // filled in by prepare(), rooms' cumulative weights
+    std::vector<double> room_cdf;
+
+    void prepare()
+    {
+        room_cdf.clear();
+        double total = 0;
+
+        for( unsigned r = 0; r < rooms; ++r )
+        {
+            total += 1 / std::pow( double( r + 1 ), room_skew );
+            room_cdf.push_back( total );
+        }
+    }
+
+    template<typename Rng>
+    unsigned pick_room( Rng& rng ) const
+    {
+        double u = std::uniform_real_distribution<double>( 0, room_cdf.back() )( rng );
+        auto it = std::upper_bound( room_cdf.begin(), room_cdf.end(), u );
+
+        return unsigned( std::min<std::ptrdiff_t>( it - room_cdf.begin(), rooms - 1 ) );
+    }
+
+    // spread evenly rather than rolled for, so the counts come out right
+    // however few clients there are. phase keeps the roles from always
+    // landing on the same clients
+    static bool one_of( double fraction, unsigned index, double phase )
+    {
+        return std::floor( ( index + 1 ) * fraction + phase ) > std::floor( index * fraction + phase );
+    }
+
+    bool lurker( unsigned index ) const { return one_of( lurkers, index, 0 ); }
+    bool churner( unsigned index ) const { return rooms > 1 && one_of( churn, index, 1 / 3.0 ); }
+    bool slow_reader( unsigned index ) const { return one_of( slow, index, 2 / 3.0 ); }
+
+    unsigned senders( unsigned clients ) const
+    {
+        unsigned n = 0;
+
+        for( unsigned i = 0; i < clients; ++i )
+        {
+            n += ! lurker( i );
+        }
+
+        return n;
+    }
+};
@@ -3,8 +3,10 @@
 #include <iostream>
 #include <msgpack.hpp>
 
-enum { max_msg_length = 1024 };
-typedef std::array<char, max_msg_length> buffer_t;
+// biggest message anyone may send, packed, and what most of them fit in.
+// message_reader turns down anything bigger, plain or framed. buffers start
+// out typical sized and only grow when something bigger comes along
+enum { max_msg_length = 64 * 1024, typical_msg_length = 1024 };
 
 
 class chat_message
@@ -24,3 +26,41 @@ public:
     MSGPACK_DEFINE( nickname, message );
 };
 
+
+// out of band requests that share the stream with chat_messages. on the wire
+// they're [command, argument], a chat_message is [nickname, message] so the
+// first element being an integer is what tells them apart
+class control_message
+{
+public:
+    enum command_t
+    {
+        join = 1,           // join room argument, it becomes the current room
+        leave = 2,          // leave room argument, or the current room if empty
+        switch_room = 3,    // leave the current room and join argument instead
+
+        // argument is a comma separated list of features the client would
+        // like (see framing.hpp), the server answers with another hello
+        // listing the ones it agreed to. a client that never says hello
+        // gets the plain msgpack stream
+        hello = 4,
+
+        // are you still there? the other side answers a ping with a pong.
+        // the server pings sessions it hasn't heard from in a while and
+        // drops them if they stay quiet, any bytes at all count as an answer
+        ping = 5,
+        pong = 6,
+
+        // the server is shutting down (or restarting, argument says which).
+        // it hangs up once everything queued for us has been sent
+        going_away = 7
+    };
+
+    control_message() : command( 0 ) {}
+    control_message( unsigned cmd, const std::string& arg ) : command( cmd ), argument( arg ) {}
+
+    unsigned    command;
+    std::string argument;
+
+    MSGPACK_DEFINE( command, argument );
+};
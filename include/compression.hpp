@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <lz4.h>
+#include <zstd.h>
+
+#include "framing.hpp"
+
+// payload compression for framed connections, negotiated by naming a codec
+// in the hello after "framed". a compressed frame carries its codec in the
+// header flags and its payload is
+//
+//     uint32 size      little endian, the uncompressed payload size
+//     ...              the codec's output
+namespace compression
+{
+    enum codec_t
+    {
+        none = 0,
+        lz4 = 1,
+        zstd = 2,
+        num_codecs
+    };
+
+    enum
+    {
+        size_prefix = 4,
+        min_size = 512,     // smaller payloads aren't worth compressing
+        zstd_level = 1      // fast, most of the ratio comes from the first levels anyway
+    };
+
+    inline const char* name( codec_t codec )
+    {
+        static const char* const names[num_codecs] = { "none", "lz4", "zstd" };
+        return names[codec];
+    }
+
+    inline codec_t from_name( const std::string& name )
+    {
+        for( int c = lz4; c < num_codecs; ++c )
+        {
+            if( name == compression::name( codec_t( c ) ) )
+            {
+                return codec_t( c );
+            }
+        }
+
+        return none;
+    }
+
+    // compress src into out, resizing it to fit. false if the codec failed
+    // or the result wasn't any smaller, send the payload as is then
+    inline bool compress( codec_t codec, const char* src, std::size_t length, std::vector<char>& out )
+    {
+        struct zstd_context
+        {
+            zstd_context() : ctx( ZSTD_createCCtx() ) {}
+            ~zstd_context() { ZSTD_freeCCtx( ctx ); }
+            ZSTD_CCtx* ctx;
+        };
+
+        std::size_t bound = codec == lz4 ? LZ4_compressBound( int( length ) ) : ZSTD_compressBound( length );
+        out.resize( size_prefix + bound );
+        framing::put_u32( out.data(), uint32_t( length ) );
+
+        std::size_t packed = 0;
+
+        if( codec == lz4 )
+        {
+            int n = LZ4_compress_default( src, out.data() + size_prefix, int( length ), int( bound ) );
+            packed = n > 0 ? std::size_t( n ) : 0;
+        }
+        else if( codec == zstd )
+        {
+            // one context per thread, ZSTD_compress() would allocate one per call
+            static thread_local zstd_context context;
+            std::size_t n = ZSTD_compressCCtx( context.ctx, out.data() + size_prefix, bound, src, length, zstd_level );
+            packed = ZSTD_isError( n ) ? 0 : n;
+        }
+
+        if( packed == 0 || size_prefix + packed >= length )
+        {
+            out.clear();
+            return false;
+        }
+
+        out.resize( size_prefix + packed );
+        return true;
+    }
+
+    // the other way, throws std::length_error if the payload is corrupt or
+    // would inflate past max_size
+    inline void decompress( codec_t codec, const char* src, std::size_t length, std::vector<char>& out, std::size_t max_size )
+    {
+        struct zstd_context
+        {
+            zstd_context() : ctx( ZSTD_createDCtx() ) {}
+            ~zstd_context() { ZSTD_freeDCtx( ctx ); }
+            ZSTD_DCtx* ctx;
+        };
+
+        if( length < size_prefix )
+        {
+            throw std::length_error( "compression: payload too short" );
+        }
+
+        std::size_t size = framing::get_u32( src );
+
+        if( size > max_size )
+        {
+            throw std::length_error( "compression: payload too big" );
+        }
+
+        out.resize( size );
+        src += size_prefix;
+        length -= size_prefix;
+
+        bool ok = false;
+
+        if( codec == lz4 )
+        {
+            ok = LZ4_decompress_safe( src, out.data(), int( length ), int( size ) ) == int( size );
+        }
+        else if( codec == zstd )
+        {
+            static thread_local zstd_context context;
+            ok = ZSTD_decompressDCtx( context.ctx, out.data(), size, src, length ) == size;
+        }
+
+        if( ! ok )
+        {
+            throw std::length_error( "compression: corrupt payload" );
+        }
+    }
+}
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/utility/string_ref.hpp>
+
+#include "common.hpp"
+
+// the framed wire format, negotiated per connection with a hello control
+// message (see control_message). every frame is a fixed header followed by
+// length bytes of msgpack:
+//
+//     uint32 length    payload bytes
+//     uint32 room      room id, 0 is the sender's current room
+//     uint32 count     msgpack objects in the payload
+//     uint8  type      chat or control
+//     uint8  flags
+//     uint16 reserved
+//
+// all little endian. with the length up front a chat payload can be routed
+// and relayed without anybody decoding it
+namespace framing
+{
+    // a chat frame batches messages of up to max_msg_length each
+    enum { header_size = 16, max_payload = 16 * max_msg_length };
+
+    enum type_t
+    {
+        chat = 1,       // count chat_messages
+        control = 2     // one control_message
+    };
+
+    // the feature name a hello asks for
+    static const char* const feature = "framed";
+
+    struct header
+    {
+        uint32_t    length;
+        uint32_t    room;
+        uint32_t    count;
+        uint8_t     type;
+        uint8_t     flags;
+    };
+
+    inline void put_u32( char* out, uint32_t v )
+    {
+        out[0] = char( v );
+        out[1] = char( v >> 8 );
+        out[2] = char( v >> 16 );
+        out[3] = char( v >> 24 );
+    }
+
+    inline uint32_t get_u32( const char* in )
+    {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>( in );
+        return uint32_t( p[0] ) | uint32_t( p[1] ) << 8 | uint32_t( p[2] ) << 16 | uint32_t( p[3] ) << 24;
+    }
+
+    inline void encode( const header& h, char* out )
+    {
+        put_u32( out, h.length );
+        put_u32( out + 4, h.room );
+        put_u32( out + 8, h.count );
+        out[12] = char( h.type );
+        out[13] = char( h.flags );
+        out[14] = 0;
+        out[15] = 0;
+    }
+
+    inline header decode( const char* in )
+    {
+        header h;
+        h.length = get_u32( in );
+        h.room = get_u32( in + 4 );
+        h.count = get_u32( in + 8 );
+        h.type = uint8_t( in[12] );
+        h.flags = uint8_t( in[13] );
+        return h;
+    }
+}
+
+// splits a framed stream back into header + payload. reads land straight in
+// the reader's buffer and payloads come out as views into it, valid until
+// the next prepare(). the buffer grows to fit the biggest frame seen, up to
+// framing::max_payload, anything bigger throws std::length_error
+class frame_reader
+{
+public:
+    enum { read_size = 16 * 1024 };
+
+    frame_reader()
+        : m_begin( 0 ),
+          m_end( 0 )
+    {
+    }
+
+    // space for the next read to land in
+    boost::asio::mutable_buffers_1 prepare()
+    {
+        std::size_t need = read_size;
+        std::size_t pending = m_end - m_begin;
+
+        // a partial frame has to end up in one piece. next() has already
+        // turned down any that claim to be too big
+        if( pending >= framing::header_size && framing::get_u32( &m_buffer[m_begin] ) <= framing::max_payload )
+        {
+            std::size_t frame = framing::header_size + framing::get_u32( &m_buffer[m_begin] );
+            need = std::max<std::size_t>( need, frame - std::min( frame, pending ) );
+        }
+
+        reserve( need );
+        return boost::asio::buffer( &m_buffer[m_end], m_buffer.size() - m_end );
+    }
+
+    // length bytes were read into the last prepare()'d buffer
+    void commit( std::size_t length )
+    {
+        m_end += length;
+    }
+
+    // bytes that arrived some other way, i.e. ones already read before the
+    // connection switched to framing
+    void append( const char* data, std::size_t length )
+    {
+        if( length == 0 )
+        {
+            return;
+        }
+
+        reserve( length );
+        std::memcpy( &m_buffer[m_end], data, length );
+        m_end += length;
+    }
+
+    // false if we need more bytes
+    bool next( framing::header& h, boost::string_ref& payload )
+    {
+        if( m_end - m_begin < framing::header_size )
+        {
+            return false;
+        }
+
+        h = framing::decode( &m_buffer[m_begin] );
+
+        if( h.length > framing::max_payload )
+        {
+            throw std::length_error( "frame_reader: frame too big" );
+        }
+
+        if( m_end - m_begin - framing::header_size < h.length )
+        {
+            return false;
+        }
+
+        payload = boost::string_ref( &m_buffer[m_begin + framing::header_size], h.length );
+        m_begin += framing::header_size + h.length;
+
+        return true;
+    }
+
+private:
+    // make sure there's room for need more bytes after m_end, sliding any
+    // partial frame to the front before growing the buffer
+    void reserve( std::size_t need )
+    {
+        if( m_begin == m_end )
+        {
+            m_begin = m_end = 0;
+        }
+
+        if( m_buffer.size() - m_end >= need )
+        {
+            return;
+        }
+
+        if( m_begin > 0 )
+        {
+            std::memmove( m_buffer.data(), &m_buffer[m_begin], m_end - m_begin );
+            m_end -= m_begin;
+            m_begin = 0;
+        }
+
+        if( m_buffer.size() - m_end < need )
+        {
+            m_buffer.resize( m_end + std::max<std::size_t>( need, read_size ) );
+        }
+    }
+
+    std::vector<char>   m_buffer;
+    std::size_t         m_begin;    // first byte not handed out yet
+    std::size_t         m_end;      // end of the bytes read so far
+};
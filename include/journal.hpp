@@ -0,0 +1,165 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/utility/string_ref.hpp>
+
+// a room journal is an append-only file of records, each one the frame the
+// server relayed:
+//
+//     uint32 length    little endian, bytes of msgpack that follow
+//     uint32 count     chat_messages packed in them
+//     length bytes     count msgpack'd chat_messages back to back
+//
+// the bytes are exactly what went out on the wire, so they can be written
+// straight to a socket again
+namespace journal_format
+{
+    enum { header_size = 8 };
+
+    inline void put_u32( char* out, uint32_t v )
+    {
+        out[0] = char( v );
+        out[1] = char( v >> 8 );
+        out[2] = char( v >> 16 );
+        out[3] = char( v >> 24 );
+    }
+
+    inline uint32_t get_u32( const char* in )
+    {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>( in );
+        return uint32_t( p[0] ) | uint32_t( p[1] ) << 8 | uint32_t( p[2] ) << 16 | uint32_t( p[3] ) << 24;
+    }
+}
+
+struct journal_record
+{
+    boost::string_ref   data;   // points into the mapping
+    uint32_t            count;
+};
+
+// reads a journal through a read-only mmap, so the file is paged in as it's
+// walked rather than loaded. consumed pages are handed back to the kernel
+// every release_bytes, replaying a journal bigger than RAM keeps a small
+// resident set. a torn record at the end (the server died mid write) is
+// treated as the end of the journal
+class journal_reader
+{
+public:
+    explicit journal_reader( const std::string& path )
+        : m_data( nullptr ),
+          m_size( 0 ),
+          m_pos( 0 ),
+          m_released( 0 )
+    {
+        int fd = ::open( path.c_str(), O_RDONLY );
+
+        if( fd < 0 )
+        {
+            throw std::runtime_error( "can't open journal " + path + ": " + std::strerror( errno ) );
+        }
+
+        struct stat st;
+
+        if( ::fstat( fd, &st ) < 0 )
+        {
+            ::close( fd );
+            throw std::runtime_error( "can't stat journal " + path + ": " + std::strerror( errno ) );
+        }
+
+        m_size = st.st_size;
+
+        if( m_size )
+        {
+            void* p = ::mmap( nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0 );
+
+            if( p == MAP_FAILED )
+            {
+                ::close( fd );
+                throw std::runtime_error( "can't map journal " + path + ": " + std::strerror( errno ) );
+            }
+
+            m_data = static_cast<const char*>( p );
+            ::madvise( p, m_size, MADV_SEQUENTIAL );
+        }
+
+        ::close( fd ); // the mapping holds its own reference
+    }
+
+    ~journal_reader()
+    {
+        if( m_data )
+        {
+            ::munmap( const_cast<char*>( m_data ), m_size );
+        }
+    }
+
+    journal_reader( const journal_reader& ) = delete;
+    journal_reader& operator=( const journal_reader& ) = delete;
+
+    // false once there are no complete records left
+    bool next( journal_record& record )
+    {
+        using namespace journal_format;
+
+        if( m_size - m_pos < header_size )
+        {
+            return false;
+        }
+
+        uint32_t length = get_u32( m_data + m_pos );
+
+        if( m_size - m_pos - header_size < length )
+        {
+            return false;
+        }
+
+        release_before( m_pos );
+
+        record.count = get_u32( m_data + m_pos + 4 );
+        record.data = boost::string_ref( m_data + m_pos + header_size, length );
+        m_pos += header_size + length;
+
+        return true;
+    }
+
+    // back to the first record
+    void rewind()
+    {
+        m_pos = 0;
+        m_released = 0;
+    }
+
+    std::size_t size() const { return m_size; }
+
+private:
+    enum { release_bytes = 64 * 1024 * 1024 };
+
+    // drop whole pages before offset from our resident set. the mapping is
+    // read-only and file backed, anything touched again is just paged back in
+    void release_before( std::size_t offset )
+    {
+        static const std::size_t page = ::sysconf( _SC_PAGESIZE );
+        std::size_t upto = offset - offset % page;
+
+        if( upto >= m_released + release_bytes )
+        {
+            ::madvise( const_cast<char*>( m_data ) + m_released, upto - m_released, MADV_DONTNEED );
+            m_released = upto;
+        }
+    }
+
+    const char*     m_data;
+    std::size_t     m_size;
+    std::size_t     m_pos;
+    std::size_t     m_released;   // everything before this has been given back
+};
@@ -0,0 +1,259 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <msgpack.hpp>
+
+#include "common.hpp"
+
+// a chat_message whose fields point into the message_reader instead of
+// owning a copy. only valid until the next message_reader::next()
+class chat_message_view
+{
+public:
+    boost::string_ref nickname;
+    boost::string_ref message;
+
+    // same wire format as chat_message, so msgpack::pack() works on a view
+    template<typename Packer>
+    void msgpack_pack( Packer& pk ) const
+    {
+        pk.pack_array( 2 );
+        pk.pack_str( nickname.size() );
+        pk.pack_str_body( nickname.data(), nickname.size() );
+        pk.pack_str( message.size() );
+        pk.pack_str_body( message.data(), message.size() );
+    }
+
+    friend std::ostream& operator<<( std::ostream& out, const chat_message_view& obj )
+    {
+        out << obj.nickname << ": " << obj.message;
+        return out;
+    }
+};
+
+// a control_message, argument points into the message_reader just like
+// chat_message_view
+class control_view
+{
+public:
+    unsigned            command;
+    boost::string_ref   argument;
+
+    friend std::ostream& operator<<( std::ostream& out, const control_view& obj )
+    {
+        out << "control(" << obj.command << ", " << obj.argument << ")";
+        return out;
+    }
+};
+
+// incrementally decodes a stream of msgpack'd chat_messages. the socket reads
+// directly into the unpacker's own buffer, and messages come out as views
+// into the unpacker's zone, which is reused from one message to the next.
+//
+//     sock.async_read_some( reader.prepare(), handler );
+//     ...
+//     reader.commit( bytes_read );
+//     while( reader.next( msg ) ) { ... }
+//
+// the amount asked for per read starts at typical_msg_length and doubles whenever
+// a read fills it, so pipelining peers get fewer, bigger reads
+class message_reader
+{
+public:
+    // msgpack starts every unpacker on a 64k buffer, which is most of what
+    // an idle connection costs. ours grows as reads need it anyway
+    enum { max_read_size = 64 * 1024, initial_buffer_size = 4 * 1024 };
+
+    // no reference func, so strings are copied into the zone rather than
+    // pointing into the buffer. a referenced buffer can't be rewound, the
+    // unpacker would malloc a fresh one every time it filled up
+    message_reader()
+        : m_unpacker( nullptr, nullptr, initial_buffer_size ),
+          m_read_size( typical_msg_length ),
+          m_zone_in_use( false )
+    {
+    }
+
+    // space for the next read to land in
+    boost::asio::mutable_buffers_1 prepare()
+    {
+        m_unpacker.reserve_buffer( m_read_size );
+        return boost::asio::buffer( m_unpacker.buffer(), m_unpacker.buffer_capacity() );
+    }
+
+    // length bytes were read into the last prepare()'d buffer
+    void commit( std::size_t length )
+    {
+        m_unpacker.buffer_consumed( length );
+
+        if( length >= m_read_size )
+        {
+            m_read_size = std::min<std::size_t>( m_read_size * 2, max_read_size );
+        }
+    }
+
+    std::size_t read_size() const { return m_read_size; }
+
+    enum result_t { need_more, got_chat, got_control };
+
+    // pull the next complete message out, filling in msg or ctl depending on
+    // what it was. throws msgpack::type_error (a std::bad_cast) if it's
+    // neither a chat_message nor a control_message, and std::length_error
+    // once it's grown past max_msg_length, complete or not
+    result_t next( chat_message_view& msg, control_view& ctl )
+    {
+        // unpacker::next() hands every message a freshly allocated zone, so
+        // run the unpacker by hand and reuse its one zone instead. the last
+        // message's views point into the zone, it can be cleared now that
+        // the caller is done with them but not while a half parsed message
+        // still has its arrays in there
+        if( m_zone_in_use )
+        {
+            m_unpacker.reset_zone();
+            m_zone_in_use = false;
+        }
+
+        bool complete = m_unpacker.execute();
+
+        // while a message is incomplete everything buffered is part of it,
+        // this is what stops a peer growing the buffer without end
+        std::size_t length = complete ? m_unpacker.parsed_size() : m_unpacker.message_size();
+
+        if( length > max_msg_length )
+        {
+            throw std::length_error( "message_reader: message too big" );
+        }
+
+        if( ! complete )
+        {
+            return need_more;
+        }
+
+        result_t result = decode( m_unpacker.data(), msg, ctl );
+
+        m_unpacker.reset();
+        m_zone_in_use = true;
+
+        return result;
+    }
+
+    // same as above for peers that only expect chat_messages, false if we
+    // need more bytes
+    bool next( chat_message_view& msg )
+    {
+        control_view ctl;
+
+        switch( next( msg, ctl ) )
+        {
+        case got_chat:
+            return true;
+
+        case got_control:
+            throw msgpack::type_error();
+
+        default:
+            return false;
+        }
+    }
+
+    // bytes read but not parsed yet, for handing over to another reader
+    // when the stream switches format. they're dropped from this one, the
+    // view is good until the next prepare()
+    boost::string_ref take_unparsed()
+    {
+        boost::string_ref rest( m_unpacker.nonparsed_buffer(), m_unpacker.nonparsed_size() );
+        m_unpacker.skip_nonparsed_buffer( rest.size() );
+        return rest;
+    }
+
+    // tell a chat_message from a control_message in an already unpacked
+    // object, throws msgpack::type_error if it's neither
+    static result_t decode( const msgpack::object& obj, chat_message_view& msg, control_view& ctl )
+    {
+        if( obj.type != msgpack::type::ARRAY || obj.via.array.size != 2
+            || obj.via.array.ptr[1].type != msgpack::type::STR )
+        {
+            throw msgpack::type_error();
+        }
+
+        const msgpack::object& first = obj.via.array.ptr[0];
+        const msgpack::object_str& second = obj.via.array.ptr[1].via.str;
+
+        if( first.type == msgpack::type::POSITIVE_INTEGER )
+        {
+            ctl.command  = static_cast<unsigned>( first.via.u64 );
+            ctl.argument = boost::string_ref( second.ptr, second.size );
+            return got_control;
+        }
+
+        if( first.type != msgpack::type::STR )
+        {
+            throw msgpack::type_error();
+        }
+
+        msg.nickname = boost::string_ref( first.via.str.ptr, first.via.str.size );
+        msg.message  = boost::string_ref( second.ptr, second.size );
+
+        return got_chat;
+    }
+
+    // make sure a framed peer's chat payload really is count chat_messages
+    // and nothing else before it's relayed as is, throws msgpack::type_error
+    // (or msgpack::unpack_error if it doesn't even parse) if it isn't, and
+    // std::length_error for a message over max_msg_length. the strings are
+    // left where they are, only the arrays go in the zone
+    static void check_chats( boost::string_ref payload, uint32_t count )
+    {
+        static thread_local msgpack::zone zone;
+        std::size_t off = 0;
+
+        for( uint32_t i = 0; i < count; ++i )
+        {
+            if( off == payload.size() )
+            {
+                throw msgpack::type_error();
+            }
+
+            zone.clear();
+
+            std::size_t start = off;
+            bool referenced;
+            msgpack::object obj = msgpack::unpack( zone, payload.data(), payload.size(), off, referenced,
+                                                   &reference_strings );
+
+            if( off - start > max_msg_length )
+            {
+                throw std::length_error( "message_reader: message too big" );
+            }
+
+            chat_message_view msg;
+            control_view ctl;
+
+            if( decode( obj, msg, ctl ) != got_chat )
+            {
+                throw msgpack::type_error();
+            }
+        }
+
+        if( off != payload.size() )
+        {
+            throw msgpack::type_error();
+        }
+    }
+
+private:
+    static bool reference_strings( msgpack::type::object_type, std::size_t, void* )
+    {
+        return true;
+    }
+
+    msgpack::unpacker   m_unpacker;
+    std::size_t         m_read_size;
+    bool                m_zone_in_use;  // by the views last handed out
+};
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+#include <boost/intrusive_ptr.hpp>
+#include <boost/lockfree/stack.hpp>
+#include <msgpack.hpp>
+
+#include "common.hpp"
+#include "framing.hpp"
+#include "compression.hpp"
+
+class frame;
+
+// a message msgpack'd once and then shared, read only, by every session it
+// gets delivered to. mutable_frame_t is for whoever is still filling it in
+typedef boost::intrusive_ptr<const frame> frame_t;
+typedef boost::intrusive_ptr<frame> mutable_frame_t;
+
+// a msgpack::sbuffer with its own reference count. when the last reference
+// goes the frame is cleared and put back in a shared pool with its buffer
+// still allocated, so once the server is warmed up building a frame doesn't
+// malloc. frames can be released on any thread, the pool is lock-free
+class frame : public msgpack::sbuffer
+{
+public:
+
+    static mutable_frame_t make()
+    {
+        frame* f = nullptr;
+
+        if( ! pool().pop( f ) )
+        {
+            f = new frame();
+        }
+
+        return mutable_frame_t( f );
+    }
+
+    // how many messages are packed in here
+    uint32_t count;
+
+    // the framing header for sessions that negotiated it, filled in by
+    // stamp() once the payload is complete. sessions on the plain stream
+    // just never send it
+    char header[framing::header_size];
+
+    void stamp( uint32_t room, framing::type_t type, uint8_t flags = 0 )
+    {
+        framing::header h = { uint32_t( size() ), room, count, uint8_t( type ), flags };
+        framing::encode( h, header );
+    }
+
+    // what stamp() said this is
+    framing::type_t type() const
+    {
+        return framing::type_t( framing::decode( header ).type );
+    }
+
+    // the payload compressed with one codec plus its own framing header.
+    // made once per frame, before it's shared, so every session that
+    // negotiated the codec sends the same bytes
+    struct packed
+    {
+        std::vector<char>   bytes;  // empty if there isn't one
+        char                header[framing::header_size];
+    };
+
+    // call after stamp(), only on a frame nobody else has yet
+    void compress( compression::codec_t codec )
+    {
+        packed& p = m_compressed[codec];
+
+        if( p.bytes.empty() && compression::compress( codec, data(), size(), p.bytes ) )
+        {
+            framing::header h = framing::decode( header );
+            h.length = p.bytes.size();
+            h.flags = uint8_t( codec );
+            framing::encode( h, p.header );
+        }
+    }
+
+    // null if the frame wasn't compressed with codec (or it didn't shrink)
+    const packed* compressed( compression::codec_t codec ) const
+    {
+        return m_compressed[codec].bytes.empty() ? nullptr : &m_compressed[codec];
+    }
+
+private:
+
+    enum { initial_size = typical_msg_length, pool_size = 1024 };
+
+    frame()
+        : msgpack::sbuffer( initial_size ),
+          count( 0 ),
+          m_refs( 0 )
+    {
+    }
+
+    typedef boost::lockfree::stack<frame*, boost::lockfree::capacity<pool_size>> pool_t;
+
+    static pool_t& pool()
+    {
+        static pool_t instance;
+        return instance;
+    }
+
+    static void recycle( frame* f )
+    {
+        f->clear();
+        f->count = 0;
+
+        for( auto& p : f->m_compressed )
+        {
+            p.bytes.clear(); // keeps the capacity for next time
+        }
+
+        if( ! pool().bounded_push( f ) )
+        {
+            delete f; // pool's full
+        }
+    }
+
+    friend void intrusive_ptr_add_ref( const frame* f )
+    {
+        f->m_refs.fetch_add( 1, std::memory_order_relaxed );
+    }
+
+    friend void intrusive_ptr_release( const frame* f )
+    {
+        if( f->m_refs.fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
+        {
+            recycle( const_cast<frame*>( f ) );
+        }
+    }
+
+    mutable std::atomic<int> m_refs;
+    packed m_compressed[compression::num_codecs];
+};
+
+frame_t encode_frame( const chat_message& msg );
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#include <boost/asio.hpp>
+
+// a small block of memory an object keeps for asio to put one handler in,
+// instead of asio calling operator new for every async operation. only one
+// handler can use it at a time, if it's busy (or too small) we fall back to
+// the heap. this is the custom allocation example from the asio docs.
+class handler_allocator
+{
+public:
+    handler_allocator() : m_in_use( false ) {}
+
+    handler_allocator( const handler_allocator& ) = delete;
+    handler_allocator& operator=( const handler_allocator& ) = delete;
+
+    void* allocate( std::size_t size )
+    {
+        if( ! m_in_use && size <= sizeof( m_storage ) )
+        {
+            m_in_use = true;
+            return &m_storage;
+        }
+
+        return ::operator new( size );
+    }
+
+    void deallocate( void* pointer )
+    {
+        if( pointer == &m_storage )
+        {
+            m_in_use = false;
+        }
+        else
+        {
+            ::operator delete( pointer );
+        }
+    }
+
+private:
+    std::aligned_storage<256>::type m_storage;
+    bool m_in_use;
+};
+
+// wraps a handler so asio allocates its operation out of a handler_allocator
+template <typename Handler>
+class custom_alloc_handler
+{
+public:
+    custom_alloc_handler( handler_allocator& a, Handler h )
+        : m_allocator( a ),
+          m_handler( std::move( h ) )
+    {
+    }
+
+    template <typename ...Args>
+    void operator()( Args&& ... args )
+    {
+        m_handler( std::forward<Args>( args )... );
+    }
+
+    friend void* asio_handler_allocate( std::size_t size, custom_alloc_handler<Handler>* this_handler )
+    {
+        return this_handler->m_allocator.allocate( size );
+    }
+
+    friend void asio_handler_deallocate( void* pointer, std::size_t /*size*/, custom_alloc_handler<Handler>* this_handler )
+    {
+        this_handler->m_allocator.deallocate( pointer );
+    }
+
+private:
+    handler_allocator& m_allocator;
+    Handler m_handler;
+};
+
+template <typename Handler>
+inline custom_alloc_handler<Handler> make_custom_alloc_handler( handler_allocator& a, Handler h )
+{
+    return custom_alloc_handler<Handler>( a, std::move( h ) );
+}
@@ -0,0 +1,281 @@
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "logger.hpp"
+#include "handoff.hpp"
+
+namespace
+{
+    enum { max_listeners = 253 }; // SCM_MAX_FD, the most one message can carry
+
+    std::runtime_error handoff_error( const std::string& what )
+    {
+        return std::runtime_error( "takeover: " + what + ": " + std::strerror( errno ) );
+    }
+}
+
+//----------------------------------------------------------------------
+
+listener_takeover::listener_takeover( const std::string& path )
+    : m_fd( ::socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 ) )
+{
+    if( m_fd < 0 )
+    {
+        throw handoff_error( "socket" );
+    }
+
+    sockaddr_un addr;
+    std::memset( &addr, 0, sizeof( addr ) );
+    addr.sun_family = AF_UNIX;
+
+    if( path.size() >= sizeof( addr.sun_path ) )
+    {
+        ::close( m_fd );
+        throw std::runtime_error( "takeover: path too long: " + path );
+    }
+
+    std::strcpy( addr.sun_path, path.c_str() );
+
+    if( ::connect( m_fd, reinterpret_cast<sockaddr*>( &addr ), sizeof( addr ) ) < 0 )
+    {
+        ::close( m_fd );
+        throw handoff_error( "can't connect to " + path );
+    }
+
+    uint32_t ports[1 + max_listeners];
+    char control[CMSG_SPACE( sizeof( int ) * max_listeners )];
+
+    iovec iov = { ports, sizeof( ports ) };
+    msghdr msg;
+    std::memset( &msg, 0, sizeof( msg ) );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof( control );
+
+    ssize_t got;
+
+    do
+    {
+        got = ::recvmsg( m_fd, &msg, MSG_CMSG_CLOEXEC );
+    }
+    while( got < 0 && errno == EINTR );
+
+    // the descriptors first, whatever else goes wrong they're ours to close
+    std::vector<int> fds;
+
+    for( cmsghdr* cmsg = CMSG_FIRSTHDR( &msg ); cmsg; cmsg = CMSG_NXTHDR( &msg, cmsg ) )
+    {
+        if( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS )
+        {
+            const int* data = reinterpret_cast<const int*>( CMSG_DATA( cmsg ) );
+            fds.insert( fds.end(), data, data + ( cmsg->cmsg_len - CMSG_LEN( 0 ) ) / sizeof( int ) );
+        }
+    }
+
+    // the rest of the ports may trail behind the first read
+    std::size_t have = got > 0 ? std::size_t( got ) : 0;
+    std::size_t want = have >= sizeof( uint32_t ) ? sizeof( uint32_t ) * ( 1 + std::min<uint32_t>( ports[0], max_listeners ) ) : 0;
+
+    while( have < want )
+    {
+        ssize_t n = ::read( m_fd, reinterpret_cast<char*>( ports ) + have, want - have );
+
+        if( n < 0 && errno == EINTR )
+        {
+            continue;
+        }
+
+        if( n <= 0 )
+        {
+            break;
+        }
+
+        have += n;
+    }
+
+    if( want == 0 || have < want || ports[0] != fds.size() || ( msg.msg_flags & MSG_CTRUNC ) )
+    {
+        for( int fd : fds )
+        {
+            ::close( fd );
+        }
+
+        ::close( m_fd );
+        throw std::runtime_error( "takeover: got a bad handoff from " + path );
+    }
+
+    for( std::size_t i = 0; i < fds.size(); ++i )
+    {
+        inherited_listener l = { static_cast<unsigned short>( ports[i + 1] ), fds[i] };
+        m_listeners.push_back( l );
+    }
+
+    TL_S_INFO << "takeover: got " << m_listeners.size() << " listening sockets from " << path;
+}
+
+listener_takeover::~listener_takeover()
+{
+    ::close( m_fd );
+}
+
+void listener_takeover::ready()
+{
+    char ok = 1;
+    ssize_t n;
+
+    do
+    {
+        n = ::write( m_fd, &ok, 1 );
+    }
+    while( n < 0 && errno == EINTR );
+
+    if( n != 1 )
+    {
+        TL_S_ERROR << "takeover: couldn't tell the old server we're ready: " << std::strerror( errno );
+    }
+}
+
+//----------------------------------------------------------------------
+
+listener_handoff::listener_handoff( boost::asio::io_service& io_service,
+                                    const std::string& path,
+                                    listeners_fn listeners,
+                                    std::function<void()> handed_off )
+    : m_acceptor( io_service ),
+      m_peer( io_service ),
+      m_listeners( listeners ),
+      m_handed_off( handed_off ),
+      m_ready( 0 )
+{
+    // whoever had the path before us (the server we took over from) is
+    // done with it
+    ::unlink( path.c_str() );
+
+    protocol::endpoint endpoint( path );
+    m_acceptor.open( endpoint.protocol() );
+    m_acceptor.bind( endpoint );
+    m_acceptor.listen();
+
+    TL_S_INFO << "handoff: waiting for a replacement on " << path;
+    do_accept();
+}
+
+void listener_handoff::close()
+{
+    boost::system::error_code ignored;
+    m_acceptor.close( ignored );
+    m_peer.close( ignored );
+}
+
+void listener_handoff::do_accept()
+{
+    m_acceptor.async_accept( m_peer, [this]( boost::system::error_code ec )
+    {
+        if( ec )
+        {
+            if( ec != boost::asio::error::operation_aborted )
+            {
+                TL_S_ERROR << "handoff: accept error: " << ec.message();
+                do_accept();
+            }
+
+            return;
+        }
+
+        TL_S_INFO << "handoff: replacement connected, sending our listening sockets";
+
+        if( ! send_listeners() )
+        {
+            boost::system::error_code ignored;
+            m_peer.close( ignored );
+            do_accept();
+            return;
+        }
+
+        wait_for_ready();
+    } );
+}
+
+bool listener_handoff::send_listeners()
+{
+    std::vector<inherited_listener> listeners = m_listeners();
+
+    if( listeners.empty() || listeners.size() > max_listeners )
+    {
+        TL_S_ERROR << "handoff: can't hand over " << listeners.size() << " listening sockets";
+        return false;
+    }
+
+    std::vector<uint32_t> ports( 1, uint32_t( listeners.size() ) );
+    std::vector<int> fds;
+
+    for( auto& l : listeners )
+    {
+        ports.push_back( l.port );
+        fds.push_back( l.fd );
+    }
+
+    std::vector<char> control( CMSG_SPACE( sizeof( int ) * fds.size() ) );
+    iovec iov = { ports.data(), ports.size() * sizeof( uint32_t ) };
+
+    msghdr msg;
+    std::memset( &msg, 0, sizeof( msg ) );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    cmsghdr* cmsg = CMSG_FIRSTHDR( &msg );
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN( sizeof( int ) * fds.size() );
+    std::memcpy( CMSG_DATA( cmsg ), fds.data(), sizeof( int ) * fds.size() );
+
+    // small enough that a fresh unix socket takes it in one go
+    ssize_t sent;
+
+    do
+    {
+        sent = ::sendmsg( m_peer.native_handle(), &msg, MSG_NOSIGNAL );
+    }
+    while( sent < 0 && errno == EINTR );
+
+    if( sent != ssize_t( iov.iov_len ) )
+    {
+        TL_S_ERROR << "handoff: sending listening sockets failed: " << std::strerror( errno );
+        return false;
+    }
+
+    return true;
+}
+
+void listener_handoff::wait_for_ready()
+{
+    boost::asio::async_read( m_peer, boost::asio::buffer( &m_ready, 1 ),
+                             [this]( boost::system::error_code ec, std::size_t )
+    {
+        boost::system::error_code ignored;
+        m_peer.close( ignored );
+
+        if( ec )
+        {
+            if( ec != boost::asio::error::operation_aborted )
+            {
+                TL_S_WARN << "handoff: replacement went away before it was ready (" << ec.message() << "), carrying on";
+                do_accept();
+            }
+
+            return;
+        }
+
+        TL_S_INFO << "handoff: replacement is accepting, handing over";
+        m_acceptor.close( ignored );
+        m_handed_off();
+    } );
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+// hot restart. the running server hands its listening sockets to its
+// replacement over a unix domain socket (SCM_RIGHTS), so something is always
+// accepting and a deploy doesn't turn into every client reconnecting at once.
+//
+//     old: server --handoff /run/chat.sock 7777
+//     new: server --takeover /run/chat.sock --handoff /run/chat.sock 7777
+//
+// the new process connects, gets every listening socket along with its port,
+// starts accepting on them and says it's ready. only then does the old one
+// stop accepting and drain its sessions. if the new one dies before that the
+// old one carries on as if nothing happened.
+//
+// on the wire it's one message from the old process, a uint32 count and
+// count uint32 ports in host order (it's the same host) with one descriptor
+// per port attached, then one byte back from the new process once it's ready
+struct inherited_listener
+{
+    unsigned short  port;
+    int             fd;
+};
+
+// the new process's end, blocking, done before anything is running
+class listener_takeover
+{
+public:
+    // connects and collects the sockets, throws std::runtime_error if that
+    // doesn't work out
+    explicit listener_takeover( const std::string& path );
+    ~listener_takeover();
+
+    listener_takeover( const listener_takeover& ) = delete;
+    listener_takeover& operator=( const listener_takeover& ) = delete;
+
+    // the descriptors are ours now, chat_server takes them over
+    const std::vector<inherited_listener>& listeners() const { return m_listeners; }
+
+    // every socket has a chat_server accepting on it, the old process can go
+    void ready();
+
+private:
+    int m_fd;
+    std::vector<inherited_listener> m_listeners;
+};
+
+// the old process's end, waits on the io_service for a replacement to turn
+// up. binding replaces whatever is at path, so a replacement can listen for
+// its own successor while we're still draining
+class listener_handoff
+{
+public:
+    typedef std::function<std::vector<inherited_listener>()> listeners_fn;
+
+    // listeners is asked for the sockets when somebody connects, handed_off
+    // is called once they've said they're ready
+    listener_handoff( boost::asio::io_service& io_service,
+                      const std::string& path,
+                      listeners_fn listeners,
+                      std::function<void()> handed_off );
+
+    // stop waiting, leaves path alone as it may be the replacement's by now
+    void close();
+
+private:
+    typedef boost::asio::local::stream_protocol protocol;
+
+    void do_accept();
+    bool send_listeners();
+    void wait_for_ready();
+
+    protocol::acceptor      m_acceptor;
+    protocol::socket        m_peer;
+    listeners_fn            m_listeners;
+    std::function<void()>   m_handed_off;
+    char                    m_ready;
+};
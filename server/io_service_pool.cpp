@@ -0,0 +1,66 @@
+#include <stdexcept>
+
+#include "logger.hpp"
+#include "io_service_pool.hpp"
+#include "metrics.hpp"
+
+io_service_pool::io_service_pool( std::size_t size, std::chrono::milliseconds tick )
+    : m_next( 0 )
+{
+    if( size == 0 )
+    {
+        throw std::runtime_error( "io_service_pool size must be at least 1" );
+    }
+
+    for( std::size_t i = 0; i < size; ++i )
+    {
+        io_service_ptr ios = std::make_shared<boost::asio::io_service>();
+        m_work.push_back( std::make_shared<boost::asio::io_service::work>( *ios ) );
+        m_io_services.push_back( ios );
+        m_wheels.emplace_back( new timer_wheel( *ios, tick ) );
+    }
+}
+
+io_service_pool::~io_service_pool()
+{
+    stop();
+}
+
+void io_service_pool::run()
+{
+    TL_S_INFO << "starting " << m_io_services.size() << " io threads";
+
+    for( std::size_t index = 0; index < m_io_services.size(); ++index )
+    {
+        io_service_ptr ios = m_io_services[index];
+        m_wheels[index]->start(); // the thread isn't running yet
+
+        m_threads.emplace_back( [ios, index]()
+        {
+            metrics::bind_thread( index );
+            ios->run();
+        } );
+    }
+}
+
+void io_service_pool::stop()
+{
+    for( auto& ios : m_io_services )
+    {
+        ios->stop();
+    }
+
+    for( auto& thread : m_threads )
+    {
+        thread.join();
+    }
+
+    m_threads.clear();
+}
+
+std::size_t io_service_pool::next_index()
+{
+    std::size_t index = m_next;
+    m_next = ( m_next + 1 ) % m_io_services.size();
+    return index;
+}
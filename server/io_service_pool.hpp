@@ -0,0 +1,55 @@
+#pragma once
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "timer_wheel.hpp"
+
+// one io_service per thread. each session is handed to one of them when it's
+// accepted and never leaves, so nothing a session owns needs a lock. every
+// thread has a timer_wheel too, for timers too numerous to give each its own
+// deadline_timer
+class io_service_pool
+{
+public:
+
+    explicit io_service_pool( std::size_t size, std::chrono::milliseconds tick = std::chrono::milliseconds( 100 ) );
+    ~io_service_pool();
+
+    io_service_pool( const io_service_pool& ) = delete;
+    io_service_pool& operator=( const io_service_pool& ) = delete;
+
+    // start a thread for every io_service, returns immediately
+    void run();
+
+    // stop every io_service and wait for the threads to finish
+    void stop();
+
+    std::size_t size() const { return m_io_services.size(); }
+
+    boost::asio::io_service& get_io_service( std::size_t index ) { return *m_io_services[index]; }
+
+    // only touch it from thread index
+    timer_wheel& get_timer_wheel( std::size_t index ) { return *m_wheels[index]; }
+
+    // round robin, only call this from the accepting thread
+    std::size_t next_index();
+
+private:
+
+    typedef std::shared_ptr<boost::asio::io_service> io_service_ptr;
+    typedef std::shared_ptr<boost::asio::io_service::work> work_ptr;
+
+    std::vector<io_service_ptr> m_io_services;
+
+    // after the io_services, they have to go first: their timers need the
+    // io_service, and sessions left in an io_service's queue get destroyed
+    // with it, once the wheels have let go of them
+    std::vector<std::unique_ptr<timer_wheel>> m_wheels;
+    std::vector<work_ptr>       m_work;
+    std::vector<std::thread>    m_threads;
+    std::size_t                 m_next;
+};
@@ -0,0 +1,336 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "journal_writer.hpp"
+
+namespace
+{
+    // room names are whatever clients asked for, keep anything that isn't
+    // obviously file name safe out of the path
+    std::string file_name( const std::string& room )
+    {
+        static const char hex[] = "0123456789abcdef";
+        std::string name;
+
+        for( std::size_t i = 0; i < room.size(); ++i )
+        {
+            unsigned char c = room[i];
+
+            if( std::isalnum( c ) || c == '_' || c == '-' || ( c == '.' && i > 0 ) )
+            {
+                name += char( c );
+            }
+            else
+            {
+                name += '%';
+                name += hex[c >> 4];
+                name += hex[c & 0xf];
+            }
+        }
+
+        return name + ".journal";
+    }
+}
+
+void room_journal::append( const frame_t& frame )
+{
+    m_writer.push( this, frame );
+}
+
+journal_writer::journal_writer( std::string dir,
+                                std::size_t batch_bytes,
+                                std::chrono::milliseconds flush_interval )
+    : m_dir( std::move( dir ) ),
+      m_batch_bytes( batch_bytes ),
+      m_flush_interval( flush_interval ),
+      m_close_pending( false ),
+      m_stop( false ),
+      m_waiting( false )
+{
+    boost::filesystem::create_directories( m_dir );
+    m_thread = std::thread( [this]() { run(); } );
+}
+
+journal_writer::~journal_writer()
+{
+    stop();
+
+    // closed after the writer stopped, its buffer is already empty
+    for( auto& j : m_closing )
+    {
+        if( j->m_fd >= 0 )
+        {
+            ::close( j->m_fd );
+        }
+    }
+
+    for( auto& j : m_journals )
+    {
+        if( j.second->m_fd >= 0 )
+        {
+            ::close( j.second->m_fd );
+        }
+    }
+}
+
+room_journal* journal_writer::open( const std::string& room )
+{
+    std::lock_guard<std::mutex> lock( m_journals_mutex );
+    std::unique_ptr<room_journal>& journal = m_journals[room];
+
+    if( ! journal )
+    {
+        std::string path = ( boost::filesystem::path( m_dir ) / file_name( room ) ).string();
+        journal.reset( new room_journal( *this, room, path ) );
+        TL_S_DEBUG << "journaling room(" << room << ") to " << path;
+    }
+
+    return journal.get();
+}
+
+void journal_writer::close( room_journal* journal )
+{
+    {
+        std::lock_guard<std::mutex> lock( m_journals_mutex );
+        auto it = m_journals.find( journal->m_room );
+
+        if( it == m_journals.end() || it->second.get() != journal )
+        {
+            return;
+        }
+
+        m_closing.push_back( std::move( it->second ) );
+        m_journals.erase( it );
+        m_close_pending = true;
+    }
+
+    wake();
+}
+
+void journal_writer::stop()
+{
+    if( m_thread.joinable() )
+    {
+        m_stop = true;
+        wake();
+        m_thread.join();
+    }
+}
+
+void journal_writer::push( room_journal* journal, const frame_t& frame )
+{
+    // the queue holds a plain pointer, so it owns a reference by hand until
+    // the writer has copied the bytes out
+    intrusive_ptr_add_ref( frame.get() );
+
+    entry e = { journal, frame.get() };
+
+    if( ! m_queue.bounded_push( e ) )
+    {
+        intrusive_ptr_release( frame.get() );
+        metrics::add( metrics::journal_dropped, frame->count );
+        return;
+    }
+
+    // pairs with the fence in wait(), either the writer sees this frame
+    // when it looks again or we see it waiting
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+
+    if( m_waiting.load( std::memory_order_relaxed ) )
+    {
+        wake();
+    }
+}
+
+void journal_writer::run()
+{
+    using namespace journal_format;
+
+    auto last_flush = std::chrono::steady_clock::now();
+
+    for( ;; )
+    {
+        bool stopping = m_stop;
+        bool got_any = false;
+        entry e;
+
+        // taken before draining the queue, so every frame appended before
+        // close() was called gets written before its journal goes
+        std::vector<std::unique_ptr<room_journal>> closing;
+
+        if( m_close_pending )
+        {
+            std::lock_guard<std::mutex> lock( m_journals_mutex );
+            closing.swap( m_closing );
+            m_close_pending = false;
+        }
+
+        while( m_queue.pop( e ) )
+        {
+            room_journal& j = *e.journal;
+            got_any = true;
+
+            char header[header_size];
+            put_u32( header, e.bytes->size() );
+            put_u32( header + 4, e.bytes->count );
+
+            j.m_buffer.insert( j.m_buffer.end(), header, header + header_size );
+            j.m_buffer.insert( j.m_buffer.end(), e.bytes->data(), e.bytes->data() + e.bytes->size() );
+            intrusive_ptr_release( e.bytes );
+
+            if( j.m_buffer.size() >= m_batch_bytes && ! closing_any( closing ) )
+            {
+                flush( j );
+            }
+            else if( ! j.m_dirty )
+            {
+                j.m_dirty = true;
+                m_dirty.push_back( &j );
+            }
+        }
+
+        if( ! closing.empty() )
+        {
+            close_journals( closing );
+        }
+
+        auto now = std::chrono::steady_clock::now();
+
+        if( stopping || ( now - last_flush >= m_flush_interval && ! closing_any( closing ) ) )
+        {
+            for( room_journal* j : m_dirty )
+            {
+                flush( *j );
+            }
+
+            m_dirty.clear();
+            last_flush = now;
+        }
+
+        if( stopping )
+        {
+            return; // everything queued before stop() has been written
+        }
+
+        if( ! got_any )
+        {
+            wait( last_flush + m_flush_interval );
+        }
+    }
+}
+
+// the queue is empty, sleep until it isn't or, with journals waiting to be
+// flushed, until that's due. m_waiting goes up before the queue is looked
+// at again so a frame pushed in between can't be missed
+void journal_writer::wait( std::chrono::steady_clock::time_point flush_due )
+{
+    std::unique_lock<std::mutex> lock( m_wake_mutex );
+    m_waiting.store( true, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+
+    if( m_queue.empty() && ! m_stop && ! m_close_pending )
+    {
+        if( m_dirty.empty() )
+        {
+            m_wake.wait( lock );
+        }
+        else
+        {
+            m_wake.wait_until( lock, flush_due );
+        }
+    }
+
+    m_waiting.store( false, std::memory_order_relaxed );
+}
+
+void journal_writer::wake()
+{
+    std::lock_guard<std::mutex> lock( m_wake_mutex );
+    m_wake.notify_one();
+}
+
+// a room recreated since its journal was closed appends to the same file,
+// so while a close is on its way nothing else gets written ahead of the old
+// journal's last frames
+bool journal_writer::closing_any( const std::vector<std::unique_ptr<room_journal>>& closing ) const
+{
+    return ! closing.empty() || m_close_pending;
+}
+
+void journal_writer::close_journals( std::vector<std::unique_ptr<room_journal>>& closing )
+{
+    for( auto& j : closing )
+    {
+        flush( *j );
+
+        if( j->m_fd >= 0 )
+        {
+            ::close( j->m_fd );
+        }
+    }
+
+    m_dirty.erase( std::remove_if( m_dirty.begin(), m_dirty.end(), [&closing]( room_journal* j )
+    {
+        return std::any_of( closing.begin(), closing.end(), [j]( const std::unique_ptr<room_journal>& c ) { return c.get() == j; } );
+    } ), m_dirty.end() );
+
+    closing.clear();
+}
+
+void journal_writer::flush( room_journal& j )
+{
+    // a journal flushed for hitting batch_bytes can still be on the dirty
+    // list, flushing it again then is just a no-op
+    j.m_dirty = false;
+
+    if( j.m_buffer.empty() )
+    {
+        return;
+    }
+
+    if( j.m_fd < 0 )
+    {
+        j.m_fd = ::open( j.m_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644 );
+
+        if( j.m_fd < 0 )
+        {
+            TL_S_ERROR << "can't open journal " << j.m_path << ": " << std::strerror( errno );
+            j.m_buffer.clear();
+            return;
+        }
+    }
+
+    const char* p = j.m_buffer.data();
+    std::size_t left = j.m_buffer.size();
+
+    while( left )
+    {
+        ssize_t n = ::write( j.m_fd, p, left );
+
+        if( n < 0 )
+        {
+            if( errno == EINTR )
+            {
+                continue;
+            }
+
+            TL_S_ERROR << "journal " << j.m_path << " write failed: " << std::strerror( errno );
+            break;
+        }
+
+        p += n;
+        left -= n;
+    }
+
+    metrics::add( metrics::journal_bytes, j.m_buffer.size() - left );
+    j.m_buffer.clear();
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/lockfree/queue.hpp>
+
+#include "frame.hpp"
+#include "journal.hpp"
+
+class journal_writer;
+
+// one room's journal file, <dir>/<room>.journal. it lives as long as its
+// room, when the registry sweeps the room the journal is closed too and a
+// recreated room opens a new one that appends to the same file
+class room_journal
+{
+public:
+    // any thread, never blocks and never allocates. the frame is only
+    // referenced, it gets copied out on the writer thread
+    void append( const frame_t& frame );
+
+private:
+    friend class journal_writer;
+
+    room_journal( journal_writer& writer, std::string room, std::string path )
+        : m_writer( writer ),
+          m_room( std::move( room ) ),
+          m_path( std::move( path ) ),
+          m_fd( -1 ),
+          m_dirty( false )
+    {
+    }
+
+    journal_writer&     m_writer;
+    const std::string   m_room;
+
+    // everything below is only touched by the writer thread
+    std::string         m_path;
+    int                 m_fd;
+    std::vector<char>   m_buffer;
+    bool                m_dirty;    // on the writer's dirty list
+};
+
+// copies relayed frames into their room's journal buffer and writes each
+// buffer out in big batches, all on its own thread so journaling costs
+// chat_room::deliver one refcount bump and a lock-free push. if the writer
+// falls behind frames are dropped (and counted) rather than slowing down
+// delivery. an idle writer sleeps until a frame comes or a flush is due
+class journal_writer
+{
+public:
+    journal_writer( std::string dir,
+                    std::size_t batch_bytes = 1024 * 1024,
+                    std::chrono::milliseconds flush_interval = std::chrono::milliseconds( 50 ) );
+    ~journal_writer();
+
+    journal_writer( const journal_writer& ) = delete;
+    journal_writer& operator=( const journal_writer& ) = delete;
+
+    // thread safe, the same room name gets the same journal until it's closed
+    room_journal* open( const std::string& room );
+
+    // thread safe, for when the journal's room has gone. nothing may append
+    // to it after this, the writer writes out what's already queued for it,
+    // closes the file and frees it
+    void close( room_journal* journal );
+
+    // write out whatever's queued and stop the writer thread
+    void stop();
+
+private:
+    friend class room_journal;
+
+    struct entry
+    {
+        room_journal*   journal;
+        const frame*    bytes;
+    };
+
+    void push( room_journal* journal, const frame_t& frame );
+    void run();
+    void flush( room_journal& journal );
+    bool closing_any( const std::vector<std::unique_ptr<room_journal>>& closing ) const;
+    void close_journals( std::vector<std::unique_ptr<room_journal>>& closing );
+    void wait( std::chrono::steady_clock::time_point flush_due );
+    void wake();
+
+    enum { queue_size = 16384 };
+
+    boost::lockfree::queue<entry, boost::lockfree::capacity<queue_size>> m_queue;
+
+    std::string                 m_dir;
+    std::size_t                 m_batch_bytes;
+    std::chrono::milliseconds   m_flush_interval;
+
+    std::mutex                  m_journals_mutex;
+    std::unordered_map<std::string, std::unique_ptr<room_journal>> m_journals;
+    std::vector<std::unique_ptr<room_journal>> m_closing;   // also under m_journals_mutex
+    std::atomic<bool>           m_close_pending;
+
+    std::vector<room_journal*>  m_dirty;    // writer thread only
+    std::atomic<bool>           m_stop;
+
+    std::atomic<bool>           m_waiting;  // the writer is about to sleep, or is
+    std::mutex                  m_wake_mutex;
+    std::condition_variable     m_wake;
+    std::thread                 m_thread;
+};
@@ -1,6 +1,12 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
 #include <boost/shared_ptr.hpp>
 #include <boost/make_shared.hpp>
-#include <boost/utility/empty_deleter.hpp>
 #include <boost/date_time.hpp>
 #include <boost/log/support/date_time.hpp>
 
@@ -8,8 +14,8 @@
 #include <boost/log/common.hpp>
 #include <boost/log/expressions.hpp>
 #include <boost/log/sinks/syslog_backend.hpp>
-#include <boost/log/sinks/sync_frontend.hpp>
-#include <boost/log/sinks/text_ostream_backend.hpp>
+#include <boost/log/sinks/unlocked_frontend.hpp>
+#include <boost/log/sinks/basic_sink_backend.hpp>
 #include <boost/log/utility/setup/common_attributes.hpp>
 
 #include <boost/log/expressions/formatter.hpp>
@@ -76,24 +82,248 @@ void set_formatter( T& sink )
     );
 }
 
-template<typename S>
-void mk_stream_logger( S stream )
+// bounded multi-producer, single-consumer ring of fixed size text slots
+// (dmitry vyukov's bounded queue). producers never lock or allocate, if the
+// ring is full push() just fails. records longer than a slot are truncated
+class log_ring
+{
+public:
+    enum { slot_size = 512 };
+
+    explicit log_ring( std::size_t slots ) // slots must be a power of 2
+        : m_slots( new slot[slots] ),
+          m_mask( slots - 1 ),
+          m_head( 0 ),
+          m_tail( 0 )
+    {
+        for( std::size_t i = 0; i < slots; ++i )
+        {
+            m_slots[i].seq.store( i, std::memory_order_relaxed );
+        }
+    }
+
+    bool push( const char* text, std::size_t len )
+    {
+        std::size_t pos = m_head.load( std::memory_order_relaxed );
+        slot* s;
+
+        for( ;; )
+        {
+            s = &m_slots[pos & m_mask];
+            std::size_t seq = s->seq.load( std::memory_order_acquire );
+            std::ptrdiff_t diff = std::ptrdiff_t( seq ) - std::ptrdiff_t( pos );
+
+            if( diff == 0 )
+            {
+                if( m_head.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+                {
+                    break;
+                }
+            }
+            else if( diff < 0 )
+            {
+                return false; // full
+            }
+            else
+            {
+                pos = m_head.load( std::memory_order_relaxed );
+            }
+        }
+
+        s->len = std::min<std::size_t>( len, slot_size );
+        std::memcpy( s->text, text, s->len );
+        s->seq.store( pos + 1, std::memory_order_release );
+
+        return true;
+    }
+
+    // consumer only, appends the next record (if any) to out
+    bool pop( std::string& out )
+    {
+        slot& s = m_slots[m_tail & m_mask];
+
+        if( s.seq.load( std::memory_order_acquire ) != m_tail + 1 )
+        {
+            return false;
+        }
+
+        out.append( s.text, s.len );
+        s.seq.store( m_tail + m_mask + 1, std::memory_order_release );
+        m_tail++;
+
+        return true;
+    }
+
+    // consumer only
+    bool empty() const
+    {
+        return m_slots[m_tail & m_mask].seq.load( std::memory_order_acquire ) != m_tail + 1;
+    }
+
+private:
+    struct slot
+    {
+        std::atomic<std::size_t> seq;
+        std::size_t len;
+        char text[slot_size];
+    };
+
+    std::unique_ptr<slot[]> m_slots;
+    std::size_t m_mask;
+    std::atomic<std::size_t> m_head;
+    char m_padding[64]; // keep producers and the consumer off each other's cache line
+    std::size_t m_tail;
+};
+
+// a backend that only copies the formatted record into a log_ring, a writer
+// thread drains the ring and writes each batch to the stream with a single
+// write and flush. the event loop never waits on the console. if the writer
+// falls behind records are dropped and counted rather than blocking. with
+// nothing to write the writer sleeps until a record arrives, producers only
+// pay for the wakeup when it's actually waiting
+class async_ostream_backend :
+    public sinks::basic_formatted_sink_backend<char, sinks::concurrent_feeding>
+{
+public:
+    async_ostream_backend( std::ostream& out, std::size_t slots )
+        : m_ring( slots ),
+          m_out( out ),
+          m_stop( false ),
+          m_dropped( 0 ),
+          m_total_dropped( 0 ),
+          m_waiting( false )
+    {
+        m_thread = std::thread( [this]() { run(); } );
+    }
+
+    ~async_ostream_backend()
+    {
+        stop();
+    }
+
+    void consume( const logging::record_view& /*rec*/, const string_type& formatted )
+    {
+        if( ! m_ring.push( formatted.data(), formatted.size() ) )
+        {
+            m_dropped.fetch_add( 1, std::memory_order_relaxed );
+            m_total_dropped.fetch_add( 1, std::memory_order_relaxed );
+        }
+
+        // pairs with the fence in wait(), either the writer sees this record
+        // when it looks again or we see it waiting
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+
+        if( m_waiting.load( std::memory_order_relaxed ) )
+        {
+            wake();
+        }
+    }
+
+    // write out whatever's left and stop the writer thread
+    void stop()
+    {
+        if( m_thread.joinable() )
+        {
+            m_stop = true;
+            wake();
+            m_thread.join();
+        }
+    }
+
+    uint64_t dropped() const { return m_total_dropped.load( std::memory_order_relaxed ); }
+
+private:
+    void run()
+    {
+        std::string batch;
+
+        for( ;; )
+        {
+            bool stopping = m_stop;
+
+            while( m_ring.pop( batch ) )
+            {
+                batch += '\n';
+            }
+
+            uint64_t dropped = m_dropped.exchange( 0, std::memory_order_relaxed );
+
+            if( dropped )
+            {
+                batch += "*W: log ring full, dropped " + std::to_string( dropped ) + " records\n";
+            }
+
+            if( ! batch.empty() )
+            {
+                m_out.write( batch.data(), batch.size() );
+                m_out.flush();
+                batch.clear();
+            }
+            else if( stopping )
+            {
+                return;
+            }
+            else
+            {
+                wait();
+            }
+        }
+    }
+
+    // the ring is empty, sleep until it isn't. m_waiting goes up before the
+    // ring is looked at again so a record pushed in between can't be missed
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock( m_wake_mutex );
+        m_waiting.store( true, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+
+        if( m_ring.empty() && ! m_stop && ! m_dropped.load( std::memory_order_relaxed ) )
+        {
+            m_wake.wait( lock );
+        }
+
+        m_waiting.store( false, std::memory_order_relaxed );
+    }
+
+    void wake()
+    {
+        std::lock_guard<std::mutex> lock( m_wake_mutex );
+        m_wake.notify_one();
+    }
+
+    log_ring            m_ring;
+    std::ostream&       m_out;
+    std::atomic<bool>   m_stop;
+    std::atomic<uint64_t> m_dropped;        // since the last "dropped" notice
+    std::atomic<uint64_t> m_total_dropped;
+
+    std::atomic<bool>   m_waiting;          // the writer is about to sleep, or is
+    std::mutex          m_wake_mutex;
+    std::condition_variable m_wake;
+    std::thread         m_thread;
+};
+
+boost::shared_ptr<async_ostream_backend> mk_async_stream_logger( std::ostream& stream )
 {
-    // Create a backend and attach a couple of streams to it
-    typedef sinks::text_ostream_backend backend_t;
-    boost::shared_ptr<backend_t> backend = boost::make_shared<backend_t>();
+    enum { ring_slots = 8192 };
 
-    backend->add_stream( stream );
-    backend->auto_flush( true ); // enable auto-flushing after each log record written
+    boost::shared_ptr<async_ostream_backend> backend = boost::make_shared<async_ostream_backend>( stream, ring_slots );
 
-    typedef sinks::synchronous_sink<backend_t> sink_t;
+    // unlocked: the backend is safe to feed from any number of threads, so
+    // no frontend mutex either
+    typedef sinks::unlocked_sink<async_ostream_backend> sink_t;
     boost::shared_ptr< sink_t > sink = boost::make_shared<sink_t>( backend );
 
     set_formatter( sink );
 
     logging::core::get()->add_sink( sink );
+
+    return backend;
 }
 
+std::atomic<Logger::severity_level> Logger::curr_level( Logger::info );
+
 Logger::Logger()
 {
     // Add some attributes
@@ -113,7 +343,15 @@ Logger::Logger()
 
 Logger::~Logger()
 {
+    if( m_async_backend )
+    {
+        m_async_backend->stop();
+    }
+}
 
+uint64_t Logger::dropped() const
+{
+    return m_async_backend ? m_async_backend->dropped() : 0;
 }
 
 void Logger::set_level( severity_level level )
@@ -125,13 +363,13 @@ void Logger::set_level( severity_level level )
     }
 
     LFC1_LOG_INFO( _logger::get() ) << "setting log level to: " << level;
-    curr_level = level;
+    curr_level.store( level, std::memory_order_relaxed );
     logging::core::get()->set_filter( severity <= level );
 }
 
 void Logger::enable_console()
 {
     logging::core::get()->set_logging_enabled( true );
-    mk_stream_logger( boost::shared_ptr< std::ostream >( &std::cout, boost::empty_deleter() ) );
+    m_async_backend = mk_async_stream_logger( std::cout );
     LFC1_LOG_INFO( _logger::get() ) << "sending logs to console";
 }
@@ -1,8 +1,13 @@
 #pragma once
 
 #include <string>
+#include <cstdint>
+#include <atomic>
+#include <boost/shared_ptr.hpp>
 #include <boost/log/common.hpp>
 
+class async_ostream_backend;
+
 class Logger
 {
 public:
@@ -25,22 +30,42 @@ public:
     }
 
     void set_level( severity_level level );
+
+    // logs go to stdout through a lock-free ring drained by a writer
+    // thread, so logging never blocks the caller on console i/o
     void enable_console();
 
-    severity_level curr_level; // the current log level, used to shortcut potentially unnecessary "to_string()" calls
+    // records thrown away because the console writer couldn't keep up
+    uint64_t dropped() const;
+
+    // the current log level, checked by TL_STREAM before going anywhere near
+    // boost::log (whose filter check costs a core lookup and a lock per record)
+    static std::atomic<severity_level> curr_level;
 
 private:
 
     Logger();
     ~Logger();
 
+    boost::shared_ptr<async_ostream_backend> m_async_backend;
+
 };
 
 BOOST_LOG_INLINE_GLOBAL_LOGGER_DEFAULT( _logger, boost::log::sources::severity_logger<Logger::severity_level> )
 
 
-// boost::log correctly shortcuts evaluating the input line if the set log level is higher than incoming message
-#define TL_STREAM(level)    BOOST_LOG_SEV( _logger::get(), level ) << __FILE__ << ":" << __LINE__ << " "
+// anything more verbose than TL_MIN_LEVEL is compiled out, build with
+// e.g. -DTL_MIN_LEVEL=3 (make LOG_LEVEL=3) to drop debug, trace and decode
+#ifndef TL_MIN_LEVEL
+#define TL_MIN_LEVEL Logger::decode
+#endif
+
+// the compile time check folds to a constant, so elided statements (and
+// everything streamed into them) are dead code. the runtime check is a
+// relaxed load, filtered out records never evaluate their arguments
+#define TL_ENABLED(level)   ( (level) <= TL_MIN_LEVEL && (level) <= Logger::curr_level.load( std::memory_order_relaxed ) )
+
+#define TL_STREAM(level)    if( ! TL_ENABLED( level ) ) {} else BOOST_LOG_SEV( _logger::get(), level ) << __FILE__ << ":" << __LINE__ << " "
 
 #define TL_S_DECODE     TL_STREAM( Logger::decode )
 #define TL_S_TRACE      TL_STREAM( Logger::trace )
@@ -3,18 +3,29 @@
 #include <string>
 #include <vector>
 #include <list>
+#include <memory>
 #include <algorithm>
+#include <sstream>
+#include <thread>
 
 #include <signal.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/bind.hpp>
 #include <boost/program_options.hpp>
 
 #include "logger.hpp"
 #include "signals.hpp"
 #include "server.hpp"
+#include "io_service_pool.hpp"
+#include "shard_exchange.hpp"
+#include "room_registry.hpp"
+#include "metrics.hpp"
+#include "journal_writer.hpp"
+#include "handoff.hpp"
 
 const std::string app_name = "server";
 const unsigned max_num_ports = 5;
@@ -32,6 +43,28 @@ bool parse_cmd_line( int argc, char** argv, po::variables_map& opts )
     desc.add_options()
     ( "help,h", "show help" )
     ( "debug,d", po::value<unsigned>()->implicit_value( Logger::debug )->default_value( Logger::info ), "enable debug logging" )
+    ( "threads,t", po::value<unsigned>()->default_value( 1 ), "number of io threads, 0 for one per core" )
+    ( "reuseport", "give every io thread its own SO_REUSEPORT acceptor" )
+    ( "queue-max-bytes", po::value<std::size_t>()->default_value( 1024 * 1024 ), "max bytes queued for writing per session" )
+    ( "queue-max-msgs", po::value<std::size_t>()->default_value( 4096 ), "max msgs queued for writing per session" )
+    ( "queue-policy", po::value<std::string>()->default_value( "drop-oldest" ), "when a write queue is full: drop-oldest or disconnect" )
+    ( "scrollback", po::value<std::size_t>()->default_value( 32 ), "frames of recent history each room sends new members, 0 for none" )
+    ( "coalesce-us", po::value<unsigned>()->default_value( 0 ), "hold writes up to this many microseconds to batch them, 0 for none" )
+    ( "coalesce-bytes", po::value<std::size_t>()->default_value( 64 * 1024 ), "write as soon as this many bytes are held back" )
+    ( "tcp-nodelay", "disable Nagle's algorithm on every session" )
+    ( "tcp-cork", "cork sessions, partial segments go out once the write queue drains" )
+    ( "sndbuf", po::value<int>()->default_value( 0 ), "SO_SNDBUF for every session, 0 for the kernel default" )
+    ( "rcvbuf", po::value<int>()->default_value( 0 ), "SO_RCVBUF for every session, 0 for the kernel default" )
+    ( "slow-bytes", po::value<std::size_t>()->default_value( 256 * 1024 ), "a session with this many bytes outstanding is slow, 0 for no limit" )
+    ( "slow-ms", po::value<unsigned>()->default_value( 500 ), "a session whose write is stuck this long is slow, 0 for no limit" )
+    ( "evict-ms", po::value<unsigned>()->default_value( 30000 ), "disconnect a session whose write is stuck this long, 0 for never" )
+    ( "latest-only", "slow sessions only get the newest msg instead of a backlog" )
+    ( "heartbeat-ms", po::value<unsigned>()->default_value( 30000 ), "ping sessions we haven't heard from in this long, 0 for never" )
+    ( "idle-timeout-ms", po::value<unsigned>()->default_value( 90000 ), "close sessions we haven't heard from in this long, 0 for never" )
+    ( "drain-timeout", po::value<unsigned>()->default_value( 10 ), "seconds a shutdown waits for sessions to flush before exiting anyway" )
+    ( "handoff", po::value<std::string>(), "wait on this unix socket for a replacement server to take our listening sockets" )
+    ( "takeover", po::value<std::string>(), "take the listening sockets over from the server waiting on this unix socket" )
+    ( "journal-dir", po::value<std::string>(), "record every room's traffic to <dir>/<room>.journal" )
     ( "ports", po::value<std::vector<unsigned> >()->required(), "listen on ports" )
     ;
 
@@ -65,11 +98,46 @@ bool parse_cmd_line( int argc, char** argv, po::variables_map& opts )
         return false;
     }
 
+    std::string policy = opts["queue-policy"].as<std::string>();
+
+    if( policy != "drop-oldest" && policy != "disconnect" )
+    {
+        cerr << "invalid queue-policy: " << policy << endl;
+        return false;
+    }
+
     Logger::instance().set_level( ( Logger::severity_level )opts["debug"].as<unsigned>() );
 
     return true;
 }
 
+server_options make_server_options( const po::variables_map& opts )
+{
+    server_options options;
+
+    options.queue_max_bytes = opts["queue-max-bytes"].as<std::size_t>();
+    options.queue_max_msgs  = opts["queue-max-msgs"].as<std::size_t>();
+    options.queue_policy    = opts["queue-policy"].as<std::string>() == "disconnect"
+                              ? server_options::disconnect
+                              : server_options::drop_oldest;
+    options.reuse_port      = opts.count( "reuseport" ) > 0;
+    options.scrollback      = opts["scrollback"].as<std::size_t>();
+    options.coalesce_window = std::chrono::microseconds( opts["coalesce-us"].as<unsigned>() );
+    options.coalesce_bytes  = opts["coalesce-bytes"].as<std::size_t>();
+    options.tcp_nodelay     = opts.count( "tcp-nodelay" ) > 0;
+    options.tcp_cork        = opts.count( "tcp-cork" ) > 0;
+    options.send_buffer     = opts["sndbuf"].as<int>();
+    options.recv_buffer     = opts["rcvbuf"].as<int>();
+    options.slow_bytes      = opts["slow-bytes"].as<std::size_t>();
+    options.slow_after      = std::chrono::milliseconds( opts["slow-ms"].as<unsigned>() );
+    options.evict_after     = std::chrono::milliseconds( opts["evict-ms"].as<unsigned>() );
+    options.latest_only     = opts.count( "latest-only" ) > 0;
+    options.heartbeat       = std::chrono::milliseconds( opts["heartbeat-ms"].as<unsigned>() );
+    options.idle_timeout    = std::chrono::milliseconds( opts["idle-timeout-ms"].as<unsigned>() );
+
+    return options;
+}
+
 int main( int argc, char* argv[] )
 {
     po::variables_map opts;
@@ -79,20 +147,177 @@ int main( int argc, char* argv[] )
         return 1;
     }
 
+    server_options options = make_server_options( opts );
+
+    unsigned threads = opts["threads"].as<unsigned>();
+
+    if( threads == 0 )
+    {
+        threads = std::max( 1u, std::thread::hardware_concurrency() );
+    }
+
     try
     {
+        // ios does the signal handling (and accepting, unless each pool
+        // thread has its own acceptor) on this thread, every session lives
+        // on one of the pool's threads
         boost::asio::io_service ios;
+        metrics::init( threads );
+        io_service_pool pool( threads );
+        shard_exchange exchange( pool );
+
+        std::unique_ptr<journal_writer> journals;
+
+        if( opts.count( "journal-dir" ) )
+        {
+            journals.reset( new journal_writer( opts["journal-dir"].as<std::string>() ) );
+        }
+
+        room_registry registry( ios, pool, exchange, journals.get(), options.scrollback );
 
         SignalHandler handler( ios );
+
+        // kill -USR1 dumps the metrics to the log
+        handler.on_usr1( [&registry]()
+        {
+            std::stringstream ss;
+            metrics::dump( ss );
+            registry.dump( ss );
+            ss << "log_dropped " << Logger::instance().dropped() << "\n";
+            TL_S_INFO << "metrics:\n" << ss.str();
+        } );
+
+        // a hot restart, the old server's listening sockets become ours
+        std::unique_ptr<listener_takeover> takeover;
+
+        if( opts.count( "takeover" ) )
+        {
+            takeover.reset( new listener_takeover( opts["takeover"].as<std::string>() ) );
+        }
+
         std::list<chat_server> servers;
 
         for( auto port : opts["ports"].as< std::vector<unsigned> >() )
         {
+            std::vector<int> inherited;
+
+            for( auto& l : takeover ? takeover->listeners() : std::vector<inherited_listener>() )
+            {
+                if( l.port == port )
+                {
+                    inherited.push_back( l.fd );
+                }
+            }
+
             tcp::endpoint endpoint( tcp::v4(), port );
-            servers.emplace_back( ios, endpoint );
+            servers.emplace_back( ios, pool, registry, endpoint, options, inherited );
+        }
+
+        if( takeover )
+        {
+            auto& ports = opts["ports"].as< std::vector<unsigned> >();
+
+            for( auto& l : takeover->listeners() )
+            {
+                if( std::find( ports.begin(), ports.end(), l.port ) == ports.end() )
+                {
+                    TL_S_WARN << "takeover: not listening on port " << l.port << " any more";
+                    ::close( l.fd );
+                }
+            }
+
+            takeover->ready();
+            takeover.reset();
+        }
+
+        // a drain stops accepting, says goodbye to every session and exits
+        // once they've all flushed and hung up, or the timeout passes
+        bool draining = false;
+        boost::asio::steady_timer drain_timer( ios );
+        auto drain_deadline = std::chrono::steady_clock::now();
+        std::function<void()> wait_for_drain;
+        std::unique_ptr<listener_handoff> handoff;
+
+        auto drain = [&]( const std::string& reason )
+        {
+            if( draining )
+            {
+                return;
+            }
+
+            TL_S_INFO << "draining for " << reason;
+            draining = true;
+
+            if( handoff )
+            {
+                handoff->close();
+            }
+
+            for( auto& server : servers )
+            {
+                server.stop_accepting();
+                server.drain( reason );
+            }
+
+            drain_deadline = std::chrono::steady_clock::now() + std::chrono::seconds( opts["drain-timeout"].as<unsigned>() );
+            wait_for_drain();
+        };
+
+        wait_for_drain = [&]()
+        {
+            drain_timer.expires_from_now( std::chrono::milliseconds( 100 ) );
+            drain_timer.async_wait( [&]( boost::system::error_code ec )
+            {
+                if( ec )
+                {
+                    return;
+                }
+
+                uint64_t live = metrics::total( metrics::sessions_opened ) - metrics::total( metrics::sessions_closed );
+
+                if( live == 0 || std::chrono::steady_clock::now() >= drain_deadline )
+                {
+                    TL_S_INFO << "drain done, " << live << " sessions left, exiting";
+                    ios.stop();
+                    return;
+                }
+
+                wait_for_drain();
+            } );
+        };
+
+        handler.on_terminate( [&drain]()
+        {
+            drain( "shutdown" );
+        } );
+
+        if( opts.count( "handoff" ) )
+        {
+            auto listeners = [&servers]()
+            {
+                std::vector<inherited_listener> all;
+
+                for( auto& server : servers )
+                {
+                    for( int fd : server.listening_fds() )
+                    {
+                        inherited_listener l = { server.port(), fd };
+                        all.push_back( l );
+                    }
+                }
+
+                return all;
+            };
+
+            handoff.reset( new listener_handoff( ios, opts["handoff"].as<std::string>(), listeners, [&drain]()
+            {
+                drain( "restart" );
+            } ) );
         }
 
+        pool.run();
         ios.run();
+        pool.stop();
     }
     catch( std::exception& e )
     {
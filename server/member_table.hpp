@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// a room's members packed into one contiguous array so fan-out is a linear
+// walk over raw pointers, no tree nodes to chase and no shared_ptr copies.
+//
+// insert() hands back a handle, erase() takes it. a handle names a slot that
+// never moves, the slot knows where its member currently sits in the dense
+// array, so erase can fill the hole with the last member in O(1). the
+// generation stops a stale handle (say, leaving twice) from erasing whoever
+// reused the slot.
+template<typename T>
+class member_table
+{
+public:
+    typedef std::shared_ptr<T> pointer;
+
+    struct handle
+    {
+        uint32_t slot;
+        uint32_t generation;
+    };
+
+    handle insert( pointer member )
+    {
+        uint32_t slot;
+
+        if( m_free.empty() )
+        {
+            slot = static_cast<uint32_t>( m_slots.size() );
+            m_slots.push_back( slot_t() );
+        }
+        else
+        {
+            slot = m_free.back();
+            m_free.pop_back();
+        }
+
+        m_slots[slot].dense = static_cast<uint32_t>( m_members.size() );
+        m_members.push_back( member.get() );
+        m_dense_slot.push_back( slot );
+        m_owners.push_back( std::move( member ) );
+
+        handle h = { slot, m_slots[slot].generation };
+        return h;
+    }
+
+    // false if the handle was stale
+    bool erase( handle h )
+    {
+        if( h.slot >= m_slots.size() || m_slots[h.slot].generation != h.generation )
+        {
+            return false;
+        }
+
+        uint32_t hole = m_slots[h.slot].dense;
+        uint32_t last = static_cast<uint32_t>( m_members.size() - 1 );
+
+        if( hole != last )
+        {
+            m_members[hole] = m_members[last];
+            m_dense_slot[hole] = m_dense_slot[last];
+            m_owners[hole] = std::move( m_owners[last] );
+            m_slots[m_dense_slot[hole]].dense = hole;
+        }
+
+        m_members.pop_back();
+        m_dense_slot.pop_back();
+        m_owners.pop_back();
+
+        m_slots[h.slot].generation++;
+        m_free.push_back( h.slot );
+
+        return true;
+    }
+
+    std::size_t size() const { return m_members.size(); }
+    bool empty() const { return m_members.empty(); }
+
+    // iterate over T*, the table keeps them alive
+    typedef typename std::vector<T*>::const_iterator const_iterator;
+    const_iterator begin() const { return m_members.begin(); }
+    const_iterator end() const { return m_members.end(); }
+
+private:
+    struct slot_t
+    {
+        slot_t() : dense( 0 ), generation( 0 ) {}
+
+        uint32_t dense;
+        uint32_t generation;
+    };
+
+    // m_members is all fan-out ever looks at. m_dense_slot and m_owners run
+    // parallel to it, m_slots and m_free are indexed by handle
+    std::vector<T*>         m_members;
+    std::vector<uint32_t>   m_dense_slot;
+    std::vector<pointer>    m_owners;
+    std::vector<slot_t>     m_slots;
+    std::vector<uint32_t>   m_free;
+};
@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <iomanip>
+
+#include "metrics.hpp"
+
+std::unique_ptr<metrics::shard_block[]> metrics::s_blocks( new metrics::shard_block[1]() );
+std::size_t metrics::s_num_blocks = 1;
+thread_local metrics::shard_block* metrics::t_block = nullptr;
+
+static const char* const counter_names[] =
+{
+    "msgs_in",
+    "msgs_out",
+    "bytes_in",
+    "bytes_out",
+    "frames_dropped",
+    "sessions_opened",
+    "sessions_closed",
+    "journal_bytes",
+    "journal_dropped",
+    "slow_sessions",
+    "slow_recovered",
+    "slow_evicted",
+    "frames_superseded",
+    "pings_sent",
+    "sessions_timed_out",
+};
+
+static const char* const histogram_names[] =
+{
+    "fanout_ns",
+    "write_latency_us",
+    "queue_depth",
+    "write_bytes",
+};
+
+void metrics::init( std::size_t threads )
+{
+    // one per thread plus the shared one at the end
+    s_blocks.reset( new shard_block[threads + 1]() );
+    s_num_blocks = threads + 1;
+}
+
+void metrics::bind_thread( std::size_t index )
+{
+    if( index < s_num_blocks - 1 )
+    {
+        t_block = &s_blocks[index];
+    }
+}
+
+void metrics::record( histogram_t h, uint64_t value )
+{
+    histogram& hist = block().histograms[h];
+
+    std::size_t bucket = 0;
+
+    while( bucket < num_buckets - 1 && ( uint64_t( 1 ) << bucket ) <= value )
+    {
+        bucket++;
+    }
+
+    hist.buckets[bucket].fetch_add( 1, std::memory_order_relaxed );
+    hist.count.fetch_add( 1, std::memory_order_relaxed );
+    hist.sum.fetch_add( value, std::memory_order_relaxed );
+
+    uint64_t max = hist.max.load( std::memory_order_relaxed );
+
+    while( value > max && ! hist.max.compare_exchange_weak( max, value, std::memory_order_relaxed ) )
+    {
+    }
+}
+
+uint64_t metrics::total( counter_t c )
+{
+    uint64_t sum = 0;
+
+    for( std::size_t i = 0; i < s_num_blocks; ++i )
+    {
+        sum += s_blocks[i].counters[c].load( std::memory_order_relaxed );
+    }
+
+    return sum;
+}
+
+void metrics::dump( std::ostream& out )
+{
+    for( int c = 0; c < num_counters; ++c )
+    {
+        out << std::left << std::setw( 20 ) << counter_names[c] << total( counter_t( c ) ) << "\n";
+    }
+
+    for( int h = 0; h < num_histograms; ++h )
+    {
+        uint64_t buckets[num_buckets] = {};
+        uint64_t count = 0, sum = 0, max = 0;
+
+        for( std::size_t i = 0; i < s_num_blocks; ++i )
+        {
+            const histogram& hist = s_blocks[i].histograms[h];
+
+            for( int b = 0; b < num_buckets; ++b )
+            {
+                buckets[b] += hist.buckets[b].load( std::memory_order_relaxed );
+            }
+
+            count += hist.count.load( std::memory_order_relaxed );
+            sum   += hist.sum.load( std::memory_order_relaxed );
+            max    = std::max( max, hist.max.load( std::memory_order_relaxed ) );
+        }
+
+        // percentiles are the upper edge of the bucket they land in
+        auto percentile = [&]( double p ) -> uint64_t
+        {
+            uint64_t want = uint64_t( count * p ), seen = 0;
+
+            for( int b = 0; b < num_buckets; ++b )
+            {
+                seen += buckets[b];
+
+                if( seen > want )
+                {
+                    return std::min( max, ( uint64_t( 1 ) << b ) - 1 );
+                }
+            }
+
+            return max;
+        };
+
+        out << std::left << std::setw( 20 ) << histogram_names[h]
+            << "count " << count
+            << " mean " << ( count ? sum / count : 0 )
+            << " p50 " << percentile( 0.5 )
+            << " p99 " << percentile( 0.99 )
+            << " max " << max << "\n";
+    }
+}
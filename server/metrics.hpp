@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+
+// server wide counters and histograms. every io thread gets its own block of
+// them so updates never share a cache line with another thread, and reading
+// is just summing the blocks with relaxed loads, nobody gets locked out.
+//
+//     metrics::add( metrics::msgs_in, n );
+//     metrics::record( metrics::fanout_ns, elapsed );
+//
+// threads call bind_thread() once to pick their block, anything that doesn't
+// (the main thread, boost::log's) shares the last one.
+class metrics
+{
+public:
+
+    enum counter_t
+    {
+        msgs_in,
+        msgs_out,
+        bytes_in,
+        bytes_out,
+        frames_dropped,
+        sessions_opened,
+        sessions_closed,
+        journal_bytes,
+        journal_dropped,    // msgs not journaled because the writer fell behind
+        slow_sessions,      // times a session fell behind its peer
+        slow_recovered,     // ... and caught up again
+        slow_evicted,       // ... or got kicked for it
+        frames_superseded,  // dropped by latest-only for a newer one
+        pings_sent,
+        sessions_timed_out, // closed for staying quiet past the idle timeout
+        num_counters
+    };
+
+    enum histogram_t
+    {
+        fanout_ns,          // one chat_room::deliver_local call
+        write_latency_us,   // async_write issued to completed
+        queue_depth,        // a session's write queue when a frame arrives
+        write_bytes,        // bytes per gathered write
+        num_histograms
+    };
+
+    // must be called before any thread binds or records
+    static void init( std::size_t threads );
+    static void bind_thread( std::size_t index );
+
+    static void add( counter_t c, uint64_t n = 1 )
+    {
+        block().counters[c].fetch_add( n, std::memory_order_relaxed );
+    }
+
+    static void record( histogram_t h, uint64_t value );
+
+    static uint64_t total( counter_t c );
+
+    static void dump( std::ostream& out );
+
+private:
+
+    enum { num_buckets = 64 }; // bucket i holds values in [2^(i-1), 2^i)
+
+    struct histogram
+    {
+        std::atomic<uint64_t> buckets[num_buckets];
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> max;
+    };
+
+    struct shard_block
+    {
+        std::atomic<uint64_t> counters[num_counters];
+        histogram histograms[num_histograms];
+        char padding[64]; // keep neighbouring blocks off each other's cache lines
+    };
+
+    static shard_block& block()
+    {
+        return *( t_block ? t_block : &s_blocks[s_num_blocks - 1] );
+    }
+
+    static std::unique_ptr<shard_block[]> s_blocks;
+    static std::size_t s_num_blocks;
+    static thread_local shard_block* t_block;
+};
@@ -0,0 +1,128 @@
+#include <algorithm>
+#include <vector>
+
+#include "logger.hpp"
+#include "journal_writer.hpp"
+#include "server.hpp"
+#include "room_registry.hpp"
+
+room_registry::room_registry( boost::asio::io_service& ios,
+                              io_service_pool& pool,
+                              shard_exchange& exchange,
+                              journal_writer* journals,
+                              std::size_t scrollback_frames,
+                              std::chrono::seconds sweep_interval )
+    : m_pool( pool ),
+      m_exchange( exchange ),
+      m_journals( journals ),
+      m_scrollback_frames( scrollback_frames ),
+      m_sweep_timer( ios ),
+      m_sweep_interval( sweep_interval )
+{
+    schedule_sweep();
+}
+
+room_registry::room_ptr room_registry::get_or_create( const std::string& name )
+{
+    bucket& b = get_bucket( name );
+    std::lock_guard<std::mutex> lock( b.mutex );
+
+    room_ptr& room = b.rooms[name];
+
+    if( ! room )
+    {
+        room_journal* journal = m_journals ? m_journals->open( name ) : nullptr;
+        room = std::make_shared<chat_room>( name, m_pool, m_exchange, journal, m_scrollback_frames );
+        TL_S_DEBUG << "creating " << *room;
+    }
+
+    return room;
+}
+
+std::size_t room_registry::sweep()
+{
+    std::size_t freed = 0;
+    std::size_t total = 0;
+
+    for( auto& b : m_buckets )
+    {
+        std::lock_guard<std::mutex> lock( b.mutex );
+
+        for( auto it = b.rooms.begin(); it != b.rooms.end(); )
+        {
+            // use_count() == 1 means only we have it, and since we hold the
+            // lock nobody can get a new pointer to it either
+            if( it->second.use_count() == 1 && it->second->size() == 0 )
+            {
+                room_journal* journal = it->second->journal();
+                it = b.rooms.erase( it );
+
+                // the room is gone so nothing can append to its journal any
+                // more, don't keep its file open until the server exits
+                if( journal )
+                {
+                    m_journals->close( journal );
+                }
+
+                freed++;
+            }
+            else
+            {
+                ++it;
+            }
+        }
+
+        total += b.rooms.size();
+    }
+
+    if( freed )
+    {
+        TL_S_DEBUG << "freed " << freed << " empty rooms, " << total << " left";
+    }
+
+    return freed;
+}
+
+void room_registry::dump( std::ostream& out, std::size_t top )
+{
+    std::vector<room_ptr> rooms;
+
+    for( auto& b : m_buckets )
+    {
+        std::lock_guard<std::mutex> lock( b.mutex );
+
+        for( auto& entry : b.rooms )
+        {
+            rooms.push_back( entry.second );
+        }
+    }
+
+    top = std::min( top, rooms.size() );
+
+    std::partial_sort( rooms.begin(), rooms.begin() + top, rooms.end(), []( const room_ptr& a, const room_ptr& b )
+    {
+        return a->msgs() > b->msgs();
+    } );
+
+    out << "rooms               " << rooms.size() << "\n";
+
+    for( std::size_t i = 0; i < top; ++i )
+    {
+        out << "  " << *rooms[i] << " members " << rooms[i]->size() << " msgs " << rooms[i]->msgs() << "\n";
+    }
+}
+
+void room_registry::schedule_sweep()
+{
+    m_sweep_timer.expires_from_now( boost::posix_time::seconds( m_sweep_interval.count() ) );
+    m_sweep_timer.async_wait( [this]( boost::system::error_code ec )
+    {
+        if( ec )
+        {
+            return;
+        }
+
+        sweep();
+        schedule_sweep();
+    } );
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <boost/asio.hpp>
+
+#include "io_service_pool.hpp"
+#include "shard_exchange.hpp"
+
+class chat_room;
+class journal_writer;
+
+// every room on every port, looked up by name. the map is split into
+// buckets by hash, each with its own lock, so sessions joining rooms from
+// different threads rarely contend. lookups only happen on join/switch,
+// never while delivering.
+//
+// rooms aren't freed the moment their last member leaves, a periodic sweep
+// drops any room that's empty and that nobody else holds a pointer to
+class room_registry
+{
+public:
+    typedef std::shared_ptr<chat_room> room_ptr;
+
+    // with journals every room records its traffic, null turns that off.
+    // scrollback_frames is how much history each room keeps for new members
+    room_registry( boost::asio::io_service& ios,
+                   io_service_pool& pool,
+                   shard_exchange& exchange,
+                   journal_writer* journals = nullptr,
+                   std::size_t scrollback_frames = 0,
+                   std::chrono::seconds sweep_interval = std::chrono::seconds( 30 ) );
+
+    room_registry( const room_registry& ) = delete;
+    room_registry& operator=( const room_registry& ) = delete;
+
+    // thread safe
+    room_ptr get_or_create( const std::string& name );
+
+    // free the rooms nobody is using any more, returns how many went
+    std::size_t sweep();
+
+    // room count and the top busiest rooms by messages delivered
+    void dump( std::ostream& out, std::size_t top = 10 );
+
+private:
+    void schedule_sweep();
+
+    enum { num_buckets = 64 };
+
+    struct bucket
+    {
+        std::mutex mutex;
+        std::unordered_map<std::string, room_ptr> rooms;
+    };
+
+    bucket& get_bucket( const std::string& name ) { return m_buckets[std::hash<std::string>()( name ) % num_buckets]; }
+
+    std::array<bucket, num_buckets> m_buckets;
+    io_service_pool&    m_pool;
+    shard_exchange&     m_exchange;
+    journal_writer*     m_journals;
+    std::size_t         m_scrollback_frames;
+
+    boost::asio::deadline_timer m_sweep_timer;
+    std::chrono::seconds        m_sweep_interval;
+};
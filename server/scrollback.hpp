@@ -0,0 +1,75 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "frame.hpp"
+
+// the last capacity frames a room delivered, kept as references to the
+// already encoded frames. the slots are allocated once up front, pushing
+// just overwrites the oldest one. each frame remembers which broadcast it
+// was (seq), which shard sent it and which it was sent on to, so a join can
+// tell the frames its shard has already seen from the ones still on their
+// way
+class scrollback
+{
+public:
+    struct entry
+    {
+        frame_t     frame;
+        uint64_t    seq;
+        std::size_t sender;
+        uint64_t    shards;     // bit per shard it was sent to
+    };
+
+    explicit scrollback( std::size_t capacity )
+        : m_entries( capacity ),
+          m_next( 0 ),
+          m_size( 0 )
+    {
+    }
+
+    void push( const frame_t& frame, uint64_t seq = 0, std::size_t sender = 0, uint64_t shards = 0 )
+    {
+        if( m_entries.empty() )
+        {
+            return;
+        }
+
+        entry& e = m_entries[m_next];
+        e.frame = frame;
+        e.seq = seq;
+        e.sender = sender;
+        e.shards = shards;
+
+        m_next = ( m_next + 1 ) % m_entries.size();
+
+        if( m_size < m_entries.size() )
+        {
+            m_size++;
+        }
+    }
+
+    // oldest first
+    template<typename F>
+    void for_each( F fn ) const
+    {
+        std::size_t capacity = m_entries.size();
+        std::size_t first = ( m_next + capacity - m_size ) % std::max<std::size_t>( capacity, 1 );
+
+        for( std::size_t i = 0; i < m_size; ++i )
+        {
+            fn( m_entries[( first + i ) % capacity] );
+        }
+    }
+
+    std::size_t capacity() const { return m_entries.size(); }
+    std::size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+private:
+    std::vector<entry>  m_entries;
+    std::size_t         m_next;     // slot the next frame goes in
+    std::size_t         m_size;
+};
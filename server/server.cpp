@@ -16,6 +16,9 @@
 #include <set>
 #include <utility>
 #include <algorithm>
+#include <atomic>
+
+#include <netinet/tcp.h>
 
 #include <boost/asio.hpp>
 #include <boost/lexical_cast.hpp>
@@ -23,62 +26,312 @@
 
 #include "logger.hpp"
 #include "server.hpp"
+#include "slab_allocator.hpp"
+#include "metrics.hpp"
 
 using boost::lexical_cast;
 using boost::asio::ip::tcp;
 
-uint64_t msg_recv=0;
-uint64_t msg_sent=0;
+// linux only, hold partial segments until uncorked
+typedef boost::asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_CORK> tcp_cork;
+
+frame_t encode_frame( const chat_message& msg )
+{
+    mutable_frame_t frame = frame::make();
+    msgpack::pack( *frame, msg );
+    frame->count = 1;
+    return frame;
+}
+
+//----------------------------------------------------------------------
 
-chat_room::chat_room( std::string name )
+chat_room::chat_room( std::string name,
+                      io_service_pool& pool,
+                      shard_exchange& exchange,
+                      room_journal* journal,
+                      std::size_t scrollback_frames )
+    : m_members( pool.size() ),
+      m_shard_size( new std::atomic<uint32_t>[pool.size()] ),
+      m_history( scrollback_frames ),
+      m_size( 0 ),
+      m_msgs( 0 ),
+      m_exchange( exchange ),
+      m_journal( journal )
 {
+    static std::atomic<uint32_t> next_id( 1 ); // 0 means "no room" on the wire
+
+    for( auto& n : m_codec_members )
+    {
+        n = 0;
+    }
+
+    for( std::size_t shard = 0; shard < pool.size(); ++shard )
+    {
+        m_shard_size[shard] = 0;
+    }
+
     m_name = name;
+    m_id = next_id++;
+}
+
+member_handle chat_room::join( chat_session::pointer member )
+{
+    std::size_t shard = member->shard();
+
+    if( ! m_members[shard] )
+    {
+        m_members[shard].reset( new members_t );
+    }
+
+    members_t& members = *m_members[shard];
+
+    if( m_history.capacity() )
+    {
+        // counted in under the history's lock, so every frame is either
+        // already in the history or will be sent here. the ones still on
+        // their way over will reach the new member along with everybody
+        // else here, only replay the rest
+        std::lock_guard<std::mutex> lock( m_history_mutex );
+        m_shard_size[shard]++;
+
+        member->deliver( m_history, [this, shard]( const scrollback::entry& e )
+        {
+            return e.sender == shard || ! has_shard( e.shards, shard )
+                   || e.seq <= m_exchange.delivered( e.sender, shard );
+        } );
+    }
+    else
+    {
+        m_shard_size[shard]++;
+    }
+
+    m_codec_members[member->codec()]++;
+
+    member_handle handle = members.insert( std::move( member ) );
+    m_size++;
+
+    TL_S_INFO << *this << ": adding member to shard " << shard << ", new length: " << members.size();
+    return handle;
 }
 
-void chat_room::join( chat_session::pointer member )
+void chat_room::leave( chat_session::pointer member, member_handle handle )
 {
-    m_members.insert( member );
-    TL_S_INFO << *this << ": adding member, new length: " << m_members.size();
+    std::size_t shard = member->shard();
+
+    if( ! m_members[shard] )
+    {
+        return;
+    }
+
+    members_t& members = *m_members[shard];
+
+    if( members.erase( handle ) )
+    {
+        m_size--;
+        m_shard_size[shard]--;
+        m_codec_members[member->codec()]--;
+    }
+
+    TL_S_INFO << *this << ": removing member from shard " << shard << ", new length: " << members.size();
+
+    if( members.size() == 0 )
+    {
+        m_members[shard].reset();
+    }
 }
 
-void chat_room::leave( chat_session::pointer member )
+void chat_room::deliver( chat_session::pointer sender, frame_t frame )
 {
-    m_members.erase( member );
-    TL_S_INFO << *this << ": removing member, new length: " << m_members.size();
+    // packed once by the sender, every member on every shard gets a
+    // reference to the same bytes. other shards' members can only be
+    // touched from their own thread so hand the frame over to them
+    std::size_t local = sender->shard();
+    m_msgs.fetch_add( frame->count, std::memory_order_relaxed );
+
+    if( m_journal )
+    {
+        m_journal->append( frame );
+    }
+
+    // numbered per shard, on its own thread, which is all a join needs to
+    // tell how far the frames from here to its shard have got
+    static thread_local uint64_t next_seq = 0;
+    uint64_t seq = ++next_seq;
+
+    // only shards with members get the frame, worked out under the same
+    // lock a join counts itself in with (see join)
+    uint64_t shards;
+
+    if( m_history.capacity() )
+    {
+        std::lock_guard<std::mutex> lock( m_history_mutex );
+        shards = busy_shards( local );
+        m_history.push( frame, seq, local, shards );
+    }
+    else
+    {
+        shards = busy_shards( local );
+    }
+
+    for( std::size_t shard = 0; shard < m_members.size(); ++shard )
+    {
+        if( shard != local && has_shard( shards, shard ) )
+        {
+            m_exchange.send( local, shard, shared_from_this(), frame, seq );
+        }
+    }
+
+    deliver_local( local, sender.get(), frame );
 }
 
-void chat_room::deliver( chat_session::pointer sender, const chat_message& msg )
+uint64_t chat_room::busy_shards( std::size_t except ) const
 {
-    for( auto member : m_members )
+    uint64_t shards = 0;
+
+    for( std::size_t shard = 0; shard < m_members.size() && shard < 64; ++shard )
+    {
+        if( shard != except && m_shard_size[shard].load( std::memory_order_relaxed ) )
+        {
+            shards |= uint64_t( 1 ) << shard;
+        }
+    }
+
+    return shards;
+}
+
+void chat_room::compress( frame& f ) const
+{
+    if( f.size() < compression::min_size )
+    {
+        return;
+    }
+
+    for( int codec = compression::lz4; codec < compression::num_codecs; ++codec )
+    {
+        if( m_codec_members[codec].load( std::memory_order_relaxed ) )
+        {
+            f.compress( compression::codec_t( codec ) );
+        }
+    }
+}
+
+void chat_room::codec_changed( compression::codec_t from, compression::codec_t to )
+{
+    m_codec_members[from]--;
+    m_codec_members[to]++;
+}
+
+void chat_room::deliver_local( std::size_t shard, const chat_session* sender, const frame_t& frame )
+{
+    members_t* members = m_members[shard].get();
+
+    if( ! members )
+    {
+        return; // nobody on this shard
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    // raw pointers, the member table keeps them alive
+    for( chat_session* member : *members )
     {
         if( sender != member )
         {
-            member->deliver( msg );
+            member->deliver( frame );
         }
     }
+
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    metrics::record( metrics::fanout_ns, std::chrono::duration_cast<std::chrono::nanoseconds>( elapsed ).count() );
 }
 
 //----------------------------------------------------------------------
 
-chat_session::chat_session( tcp::socket socket, chat_room& room )
+chat_session::chat_session( tcp::socket socket,
+                            room_registry& registry,
+                            room_ptr lobby,
+                            const server_options& options,
+                            std::size_t shard,
+                            timer_wheel& wheel,
+                            session_table& sessions )
     : m_socket( std::move( socket ) ),
-      m_room( room )
+      m_registry( registry ),
+      m_lobby( lobby ),
+      m_options( options ),
+      m_shard( shard ),
+      m_sessions( sessions ),
+      m_session_handle(),
+      m_draining( false ),
+      m_framed_in( false ),
+      m_framed_out( false ),
+      m_unframed( 0 ),
+      m_codec( compression::none ),
+      m_queued_bytes( 0 ),
+      m_writing_bytes( 0 ),
+      m_closing( false ),
+      m_slow( false ),
+      m_flush_timer( m_socket.get_io_service() ),
+      m_flush_scheduled( false ),
+      m_wheel( wheel ),
+      m_last_read( 0 ),
+      m_heartbeat_ticks( wheel.ticks( options.heartbeat ) ),
+      m_idle_ticks( wheel.ticks( options.idle_timeout ) )
 {
     TL_S_DEBUG << "creating " << *this;
 }
 
 chat_session::~chat_session()
 {
-    TL_S_INFO << "grand totals: recv: " << msg_recv << ", sent: " << msg_sent;
+    metrics::add( metrics::sessions_closed );
+    TL_S_INFO << "grand totals: recv: " << metrics::total( metrics::msgs_in ) << ", sent: " << metrics::total( metrics::msgs_out );
 }
 
 void chat_session::start()
 {
     TL_S_DEBUG << *this << ": started";
-    m_room.join( shared_from_this() );
+    metrics::add( metrics::sessions_opened );
+    m_session_handle = m_sessions.insert( shared_from_this() );
+    set_socket_options();
+    join_room( m_lobby );
+
+    // raw this, the entry unlinks itself when we're destroyed
+    m_last_read = m_wheel.now();
+    m_idle.callback = [this]() { check_idle(); };
+    schedule_idle();
+
     do_read();
 }
 
+void chat_session::set_socket_options()
+{
+    boost::system::error_code ec;
+
+    if( m_options.tcp_nodelay )
+    {
+        m_socket.set_option( tcp::no_delay( true ), ec );
+    }
+
+    if( ! ec && m_options.tcp_cork )
+    {
+        m_socket.set_option( tcp_cork( true ), ec );
+    }
+
+    if( ! ec && m_options.send_buffer )
+    {
+        m_socket.set_option( boost::asio::socket_base::send_buffer_size( m_options.send_buffer ), ec );
+    }
+
+    if( ! ec && m_options.recv_buffer )
+    {
+        m_socket.set_option( boost::asio::socket_base::receive_buffer_size( m_options.recv_buffer ), ec );
+    }
+
+    if( ec )
+    {
+        TL_S_WARN << *this << ": setting socket options: " << ec.message();
+    }
+}
+
 void chat_session::do_read()
 {
     //TL_S_TRACE << *this << ": listening to " << m_socket.remote_endpoint();
@@ -86,8 +339,9 @@ void chat_session::do_read()
     auto self( shared_from_this() );
 
     m_socket.async_read_some(
-        boost::asio::buffer( m_read_buff.data(), 1024 ),
-        [this, self]( boost::system::error_code ec, std::size_t length )
+        m_framed_in ? m_frames.prepare() : m_reader.prepare(),
+        make_custom_alloc_handler( m_read_alloc,
+                                   [this, self]( boost::system::error_code ec, std::size_t length )
     {
         TL_S_DEBUG << *this << ": recv'd " << length << " bytes";
 
@@ -112,23 +366,18 @@ void chat_session::do_read()
 
         try
         {
-            // feed data to unpacker, need to decode incoming bytes
-            // because we only want to send full messages
-            m_unpacker.reserve_buffer( length );
-            std::copy( m_read_buff.data(), m_read_buff.data() + length, m_unpacker.buffer() );
-            m_unpacker.buffer_consumed( length );
+            metrics::add( metrics::bytes_in, length );
+            m_last_read = m_wheel.now();
 
-            // maybe-get object out of it
-            msgpack::unpacked result;
-
-            if( m_unpacker.next( &result ) )
+            if( m_framed_in )
             {
-                msg_recv++;
-                chat_message msg;
-                result.get().convert( &msg );
-                TL_S_TRACE << *self << ": " << msg;
-
-                m_room.deliver( self, msg );
+                m_frames.commit( length );
+                read_frames();
+            }
+            else
+            {
+                m_reader.commit( length );
+                read_messages();
             }
 
             do_read();
@@ -138,26 +387,631 @@ void chat_session::do_read()
             TL_S_ERROR << *self << ": client sent garbage, dropping";
             close();
         }
+        catch( msgpack::unpack_error& e )
+        {
+            TL_S_ERROR << *self << ": client sent malformed msgpack (" << e.what() << "), dropping";
+            close();
+        }
+        catch( std::length_error& e )
+        {
+            TL_S_ERROR << *self << ": " << e.what() << ", dropping";
+            close();
+        }
+    } ) );
+}
+
+void chat_session::read_messages()
+{
+    // the bytes landed directly in the unpacker, pull out every complete
+    // message, a pipelining client can easily fit several into one read.
+    // they're re-packed straight from the views so nothing gets copied into
+    // a std::string on the way through
+    chat_message_view msg;
+    control_view ctl;
+    mutable_frame_t frame;
+    message_reader::result_t result;
+
+    while( ( result = m_reader.next( msg, ctl ) ) != message_reader::need_more )
+    {
+        if( result == message_reader::got_control )
+        {
+            // what's batched so far belongs to the room we were in before
+            // this message, send it on its way first
+            if( frame )
+            {
+                deliver_to( m_current, frame );
+                frame.reset();
+            }
+
+            handle_control( ctl );
+
+            if( m_framed_in )
+            {
+                // that was a hello, everything after it is framed
+                boost::string_ref rest = m_reader.take_unparsed();
+                m_frames.append( rest.data(), rest.size() );
+                read_frames();
+                return;
+            }
+
+            continue;
+        }
+
+        TL_S_TRACE << *this << ": " << msg;
+
+        if( ! frame )
+        {
+            frame = frame::make();
+        }
+
+        msgpack::pack( *frame, msg );
+        frame->count++;
+    }
+
+    if( frame )
+    {
+        deliver_to( m_current, frame );
+    }
+}
+
+void chat_session::read_frames()
+{
+    framing::header h;
+    boost::string_ref payload;
+
+    while( m_frames.next( h, payload ) )
+    {
+        if( h.type == framing::control )
+        {
+            if( payload.size() > max_msg_length )
+            {
+                throw std::length_error( "control frame too big" );
+            }
+
+            // rare enough to just unpack
+            msgpack::unpacked unpacked;
+            msgpack::unpack( unpacked, payload.data(), payload.size() );
+
+            chat_message_view msg;
+            control_view ctl;
+
+            if( message_reader::decode( unpacked.get(), msg, ctl ) != message_reader::got_control )
+            {
+                throw msgpack::type_error();
+            }
+
+            handle_control( ctl );
+            continue;
+        }
+
+        if( h.type != framing::chat || h.flags )
+        {
+            // compression is only for what we send, not what we get
+            TL_S_WARN << *this << ": unknown frame type " << int( h.type )
+                      << " flags " << int( h.flags ) << ", ignoring";
+            continue;
+        }
+
+        room_ptr room = h.room ? find_room( h.room ) : m_current;
+
+        if( ! room )
+        {
+            TL_S_DEBUG << *this << ": not in room " << h.room << ", dropping " << h.count << " msgs";
+            continue;
+        }
+
+        // the fast path, the payload is relayed as is without re-packing it.
+        // the plain stream peers, scrollback and the journal get exactly
+        // these bytes, so it's checked to be the chat_messages it claims
+        // first, a control message slipped in would reach them as real
+        message_reader::check_chats( payload, h.count );
+
+        mutable_frame_t frame = frame::make();
+        frame->write( payload.data(), payload.size() );
+        frame->count = h.count;
+
+        deliver_to( room, frame );
+    }
+}
+
+void chat_session::deliver_to( const room_ptr& room, mutable_frame_t& frame )
+{
+    metrics::add( metrics::msgs_in, frame->count );
+
+    if( room )
+    {
+        frame->stamp( room->id(), framing::chat );
+        room->compress( *frame );
+        room->deliver( shared_from_this(), frame );
+    }
+}
+
+room_ptr chat_session::find_room( uint32_t id ) const
+{
+    for( auto& m : m_rooms )
+    {
+        if( m.room->id() == id )
+        {
+            return m.room;
+        }
+    }
+
+    return room_ptr();
+}
+
+void chat_session::send_control( const room_ptr& room, unsigned command, const std::string& argument )
+{
+    mutable_frame_t frame = frame::make();
+    msgpack::pack( *frame, control_message( command, argument ) );
+    frame->count = 1;
+    frame->stamp( room ? room->id() : 0, framing::control );
+
+    deliver( frame );
+}
+
+void chat_session::deliver( frame_t frame )
+{
+    if( enqueue( frame ) )
+    {
+        flush_or_wait();
+    }
+}
+
+void chat_session::flush_or_wait()
+{
+    if( ! m_writing.empty() )
+    {
+        return; // whatever's queued goes out when the current write is done
+    }
+
+    if( m_options.coalesce_window.count() == 0 || m_queued_bytes >= m_options.coalesce_bytes )
+    {
+        do_write();
+        return;
+    }
+
+    if( m_flush_scheduled )
+    {
+        return;
+    }
+
+    // the timer isn't cancelled if the bytes limit flushes first, firing
+    // late just finds nothing (or very little) to write
+    m_flush_scheduled = true;
+    m_flush_timer.expires_from_now( m_options.coalesce_window );
+
+    auto self( shared_from_this() );
+    m_flush_timer.async_wait( make_custom_alloc_handler( m_flush_alloc,
+                                                         [this, self]( boost::system::error_code )
+    {
+        m_flush_scheduled = false;
+
+        if( ! m_closing && m_writing.empty() && ! m_write_queue.empty() )
+        {
+            do_write();
+        }
+    } ) );
+}
+
+bool chat_session::enqueue( const frame_t& frame )
+{
+    if( m_closing )
+    {
+        return false;
+    }
+
+    // only worth looking at the clock once frames start backing up behind
+    // a write
+    if( ! m_writing.empty() && ! m_write_queue.empty() )
+    {
+        check_slow();
+
+        if( m_closing )
+        {
+            return false;
+        }
+    }
+
+    if( m_slow && m_options.latest_only && frame->type() == framing::chat )
+    {
+        supersede();
+    }
+
+    if( over_high_water( frame->size() ) )
+    {
+        if( m_options.queue_policy == server_options::disconnect )
+        {
+            TL_S_WARN << *this << ": write queue full (" << m_write_queue.size()
+                      << " msgs, " << m_queued_bytes << " bytes), disconnecting";
+
+            disconnect_later();
+            return false;
+        }
+
+        std::size_t dropped = 0;
+
+        while( dropped < m_write_queue.size() && over_high_water( frame->size() ) )
+        {
+            m_queued_bytes -= m_write_queue[dropped]->size();
+            dropped++;
+        }
+
+        m_write_queue.erase( m_write_queue.begin(), m_write_queue.begin() + dropped );
+        m_unframed -= std::min( m_unframed, dropped );
+        metrics::add( metrics::frames_dropped, dropped );
+
+        TL_S_DEBUG << *this << ": write queue full, dropped " << dropped << " oldest msgs";
+    }
+
+    metrics::record( metrics::queue_depth, m_write_queue.size() );
+    m_write_queue.push_back( frame );
+    m_queued_bytes += frame->size();
+
+    return true;
+}
+
+void chat_session::check_slow()
+{
+    auto stalled = std::chrono::steady_clock::now() - m_write_started;
+
+    if( m_options.evict_after.count() && stalled >= m_options.evict_after )
+    {
+        TL_S_WARN << *this << ": no write completed in "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>( stalled ).count()
+                  << "ms, " << m_queued_bytes + m_writing_bytes << " bytes outstanding, disconnecting";
+
+        metrics::add( metrics::slow_evicted );
+        disconnect_later();
+        return;
+    }
+
+    if( m_slow )
+    {
+        return;
+    }
+
+    if( ( m_options.slow_bytes && m_queued_bytes + m_writing_bytes >= m_options.slow_bytes )
+            || ( m_options.slow_after.count() && stalled >= m_options.slow_after ) )
+    {
+        TL_S_INFO << *this << ": slow consumer, " << m_queued_bytes + m_writing_bytes << " bytes outstanding"
+                  << ( m_options.latest_only ? ", only sending the latest msgs" : "" );
+
+        m_slow = true;
+        metrics::add( metrics::slow_sessions );
+    }
+}
+
+void chat_session::supersede()
+{
+    // a new chat frame makes every queued one stale. control frames stay,
+    // a peer that misses a join can't place what comes after it
+    std::size_t kept = 0;
+    std::size_t unframed = 0;
+
+    for( std::size_t i = 0; i < m_write_queue.size(); ++i )
+    {
+        if( m_write_queue[i]->type() == framing::control )
+        {
+            unframed += i < m_unframed ? 1 : 0;
+            std::swap( m_write_queue[kept++], m_write_queue[i] );
+        }
+        else
+        {
+            m_queued_bytes -= m_write_queue[i]->size();
+        }
+    }
+
+    metrics::add( metrics::frames_superseded, m_write_queue.size() - kept );
+    m_write_queue.resize( kept );
+    m_unframed = unframed;
+}
+
+void chat_session::disconnect_later()
+{
+    // we're being called from inside chat_room::deliver so we can't
+    // leave the room right now, let the io_service do it
+    m_closing = true;
+    m_write_queue.clear();
+    m_queued_bytes = 0;
+
+    auto self( shared_from_this() );
+    m_socket.get_io_service().post( [self]() { self->close(); } );
+}
+
+void chat_session::schedule_idle()
+{
+    // wake up when the first of a ping or the timeout could be due,
+    // counting from the last read. a ping that's already gone out is
+    // repeated every heartbeat until they answer or time out
+    timer_wheel::tick_t now = m_wheel.now();
+    timer_wheel::tick_t at = 0;
+
+    if( m_idle_ticks )
+    {
+        at = m_last_read + m_idle_ticks;
+    }
+
+    if( m_heartbeat_ticks )
+    {
+        timer_wheel::tick_t ping = m_last_read + m_heartbeat_ticks;
+
+        if( ping <= now )
+        {
+            ping = now + m_heartbeat_ticks;
+        }
+
+        at = at ? std::min( at, ping ) : ping;
+    }
+
+    if( at )
+    {
+        m_wheel.schedule( m_idle, at );
+    }
+}
+
+void chat_session::check_idle()
+{
+    if( m_closing )
+    {
+        return;
+    }
+
+    auto self( shared_from_this() ); // close() may let go of the last reference
+    timer_wheel::tick_t quiet = m_wheel.now() - m_last_read;
+
+    if( m_idle_ticks && quiet >= m_idle_ticks )
+    {
+        TL_S_INFO << *this << ": nothing heard for " << m_options.idle_timeout.count() << "ms, closing";
+        metrics::add( metrics::sessions_timed_out );
+        close();
+        return;
+    }
+
+    if( m_heartbeat_ticks && quiet >= m_heartbeat_ticks )
+    {
+        TL_S_DEBUG << *this << ": quiet for " << quiet << " ticks, pinging";
+        metrics::add( metrics::pings_sent );
+        send_control( room_ptr(), control_message::ping, "" );
+    }
+
+    schedule_idle();
+}
+
+void chat_session::handle_control( const control_view& ctl )
+{
+    TL_S_DEBUG << *this << ": " << ctl;
+
+    std::string name = ctl.argument.to_string();
+
+    switch( ctl.command )
+    {
+    case control_message::join:
+        join_room( m_registry.get_or_create( name ) );
+        break;
+
+    case control_message::switch_room:
+    {
+        room_ptr room = m_registry.get_or_create( name );
+
+        if( room != m_current )
+        {
+            leave_room( m_current );
+        }
+
+        join_room( room );
+        break;
+    }
+
+    case control_message::hello:
+        negotiate( name );
+        break;
+
+    case control_message::ping:
+        send_control( room_ptr(), control_message::pong, "" );
+        break;
+
+    case control_message::pong:
+        break; // the read already counted
+
+    case control_message::leave:
+        if( name.empty() )
+        {
+            leave_room( m_current );
+        }
+        else
+        {
+            auto it = std::find_if( m_rooms.begin(), m_rooms.end(), [&name]( const membership& m )
+            {
+                return m.room->name() == name;
+            } );
+
+            if( it != m_rooms.end() )
+            {
+                leave_room( it->room );
+            }
+        }
+        break;
+
+    default:
+        TL_S_WARN << *this << ": unknown control command " << ctl.command << ", ignoring";
+        break;
+    }
+}
+
+void chat_session::negotiate( const std::string& features )
+{
+    std::vector<std::string> wanted;
+    std::size_t begin = 0;
+
+    while( begin <= features.size() )
+    {
+        std::size_t end = std::min( features.find( ',', begin ), features.size() );
+        wanted.push_back( features.substr( begin, end - begin ) );
+        begin = end + 1;
+    }
+
+    bool framing = ! m_framed_in && std::find( wanted.begin(), wanted.end(), framing::feature ) != wanted.end();
+    compression::codec_t codec = compression::none;
+
+    // compressed payloads only make sense with frames, the first codec we
+    // know of wins
+    if( m_framed_in || framing )
+    {
+        for( auto& w : wanted )
+        {
+            if( ( codec = compression::from_name( w ) ) != compression::none )
+            {
+                break;
+            }
+        }
+    }
+
+    std::string agreed = framing ? framing::feature : "";
+
+    if( codec != compression::none )
+    {
+        agreed += agreed.empty() ? "" : ",";
+        agreed += compression::name( codec );
+    }
+
+    // the reply goes out in whatever format the peer has now, so anything
+    // queued up to and including it is sent plain
+    send_control( room_ptr(), control_message::hello, agreed );
+
+    if( codec != m_codec )
+    {
+        for( auto& m : m_rooms )
+        {
+            m.room->codec_changed( m_codec, codec );
+        }
+
+        m_codec = codec;
+    }
+
+    if( framing )
+    {
+        TL_S_DEBUG << *this << ": switching to framing, compression " << compression::name( m_codec );
+        m_framed_in = true;
+        m_framed_out = true;
+        m_unframed = m_write_queue.size();
+
+        // catch them up on the rooms they're already in
+        for( auto& m : m_rooms )
+        {
+            send_control( m.room, control_message::join, m.room->name() );
+        }
+    }
+}
+
+void chat_session::join_room( room_ptr room )
+{
+    if( m_draining )
+    {
+        return; // on our way out
+    }
+
+    auto it = std::find_if( m_rooms.begin(), m_rooms.end(), [&room]( const membership& m )
+    {
+        return m.room == room;
     } );
+
+    if( it == m_rooms.end() )
+    {
+        // framed peers learn the room's id before any of its frames
+        // (the scrollback comes with the join) show up
+        if( m_framed_out )
+        {
+            send_control( room, control_message::join, room->name() );
+        }
+
+        membership m = { room, room->join( shared_from_this() ) };
+        m_rooms.push_back( m );
+    }
+
+    m_current = room;
+}
+
+void chat_session::leave_room( room_ptr room )
+{
+    if( ! room )
+    {
+        return;
+    }
+
+    auto it = std::find_if( m_rooms.begin(), m_rooms.end(), [&room]( const membership& m )
+    {
+        return m.room == room;
+    } );
+
+    if( it == m_rooms.end() )
+    {
+        return;
+    }
+
+    room->leave( shared_from_this(), it->handle );
+    m_rooms.erase( it );
+
+    if( m_framed_out )
+    {
+        send_control( room, control_message::leave, room->name() );
+    }
+
+    if( m_current == room )
+    {
+        // talk to whichever room we joined most recently, if any
+        m_current = m_rooms.empty() ? room_ptr() : m_rooms.back().room;
+    }
 }
 
-void chat_session::deliver( const chat_message& msg )
+bool chat_session::over_high_water( std::size_t extra_bytes ) const
 {
-    m_msg = msg;
-    do_write();
+    return m_write_queue.size() + 1 > m_options.queue_max_msgs
+           || m_queued_bytes + extra_bytes > m_options.queue_max_bytes;
 }
 
 void chat_session::do_write()
 {
-    TL_S_TRACE << *this <<  ": delivering";
+    TL_S_TRACE << *this <<  ": delivering " << m_write_queue.size() << " msgs";
+
+    // everything queued so far goes out as one gathered write, the frames
+    // move into m_writing so they stay alive until the write completes
+    m_write_bufs.clear();
+
+    for( auto& frame : m_write_queue )
+    {
+        const char* header = nullptr;
+        boost::asio::const_buffer payload = boost::asio::buffer( frame->data(), frame->size() );
+
+        if( m_unframed )
+        {
+            m_unframed--; // queued before the switch, goes out plain
+        }
+        else if( m_framed_out )
+        {
+            auto packed = m_codec ? frame->compressed( m_codec ) : nullptr;
+
+            header = packed ? packed->header : frame->header;
+            payload = packed ? boost::asio::buffer( packed->bytes ) : payload;
+        }
+
+        if( header )
+        {
+            m_write_bufs.push_back( boost::asio::buffer( header, framing::header_size ) );
+        }
+
+        m_write_bufs.push_back( payload );
+        m_writing.push_back( std::move( frame ) );
+    }
 
-    m_packer.clear();
-    msgpack::pack( m_packer, m_msg );
+    m_write_queue.clear();
+    m_writing_bytes = boost::asio::buffer_size( m_write_bufs );
+    m_queued_bytes = 0;
+    m_write_started = std::chrono::steady_clock::now();
 
-    auto buffer = boost::asio::buffer( m_packer.data(), m_packer.size() );
     auto self( shared_from_this() );
-    boost::asio::async_write( m_socket, buffer,
-                              [this, self]( boost::system::error_code ec, std::size_t length )
+    boost::asio::async_write( m_socket, m_write_bufs,
+                              make_custom_alloc_handler( m_write_alloc,
+                                                         [this, self]( boost::system::error_code ec, std::size_t length )
     {
         if( ec )
         {
@@ -174,58 +1028,278 @@ void chat_session::do_write()
                 TL_S_WARN << *self << ": do_write: error: " << ec.message();
             }
 
+            m_writing.clear();
             close();
             return;
         }
 
-        msg_sent++;
+        auto elapsed = std::chrono::steady_clock::now() - m_write_started;
+        metrics::record( metrics::write_latency_us, std::chrono::duration_cast<std::chrono::microseconds>( elapsed ).count() );
+        metrics::add( metrics::bytes_out, length );
+
+        uint64_t msgs = 0;
+
+        for( auto& frame : m_writing )
+        {
+            msgs += frame->count;
+        }
+
+        metrics::add( metrics::msgs_out, msgs );
+        metrics::record( metrics::write_bytes, length );
         TL_S_TRACE << *self << ": wrote " << length << " bytes";
-    } );
+
+        m_writing.clear();
+        m_writing_bytes = 0;
+
+        if( m_draining && m_write_queue.empty() )
+        {
+            // the goodbye is out, let them see the end of the stream
+            TL_S_DEBUG << *self << ": drained, hanging up";
+            boost::system::error_code ignored;
+            m_socket.shutdown( tcp::socket::shutdown_send, ignored );
+            close();
+            return;
+        }
+
+        if( m_slow && ( ! m_options.slow_bytes || m_queued_bytes * 2 < m_options.slow_bytes ) )
+        {
+            TL_S_INFO << *self << ": caught up";
+            m_slow = false;
+            metrics::add( metrics::slow_recovered );
+        }
+
+        if( ! m_write_queue.empty() )
+        {
+            do_write();
+        }
+        else if( m_options.tcp_cork )
+        {
+            // nothing else coming for now, push out the partial segment
+            boost::system::error_code ignored;
+            m_socket.set_option( tcp_cork( false ), ignored );
+            m_socket.set_option( tcp_cork( true ), ignored );
+        }
+    } ) );
+}
+
+void chat_session::drain( const std::string& reason )
+{
+    if( m_closing || m_draining )
+    {
+        return;
+    }
+
+    TL_S_DEBUG << *this << ": draining";
+
+    // out of every room first so nothing new gets queued behind the goodbye
+    auto self( shared_from_this() );
+
+    for( auto& m : m_rooms )
+    {
+        m.room->leave( self, m.handle );
+    }
+
+    m_rooms.clear();
+    m_current.reset();
+
+    send_control( room_ptr(), control_message::going_away, reason );
+    m_draining = true;
 }
 
 void chat_session::close()
 {
     TL_S_INFO << "closing";
 
+    m_closing = true;
+    m_write_queue.clear();
+    m_queued_bytes = 0;
+
     boost::system::error_code ec;
     m_socket.cancel(ec);
+    m_flush_timer.cancel(ec);
+    m_idle.cancel();
 
     auto self( shared_from_this() );
-    m_room.leave( self );
+    m_sessions.erase( m_session_handle );
+
+    for( auto& m : m_rooms )
+    {
+        m.room->leave( self, m.handle );
+    }
+
+    m_rooms.clear();
+    m_current.reset();
 }
 
 //----------------------------------------------------------------------
 
 chat_server::chat_server( boost::asio::io_service& io_service,
-                          const tcp::endpoint& endpoint )
-    : m_acceptor( io_service, endpoint ),
-      m_socket( io_service ),
-      m_room( lexical_cast<std::string>( endpoint.port() ) )
+                          io_service_pool& pool,
+                          room_registry& registry,
+                          const tcp::endpoint& endpoint,
+                          const server_options& options,
+                          const std::vector<int>& inherited )
+    : m_pool( pool ),
+      m_registry( registry ),
+      m_room( registry.get_or_create( lexical_cast<std::string>( endpoint.port() ) ) ),
+      m_options( options ),
+      m_port( endpoint.port() ),
+      m_sessions( pool.size() )
 {
+    // sockets taken over from the server we're replacing come first, they
+    // may well have connections queued already. with reuse_port they're
+    // dealt out over the shards
+    for( std::size_t i = 0; i < inherited.size(); ++i )
+    {
+        boost::asio::io_service& ios = m_options.reuse_port ? m_pool.get_io_service( i % m_pool.size() ) : io_service;
+        acceptor_ptr acceptor( new tcp::acceptor( ios ) );
+        acceptor->assign( endpoint.protocol(), inherited[i] );
+        m_acceptors.push_back( std::move( acceptor ) );
+    }
+
+    if( m_options.reuse_port )
+    {
+        // let the kernel spread new connections over the shards
+        typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+
+        for( std::size_t shard = m_acceptors.size(); shard < m_pool.size(); ++shard )
+        {
+            acceptor_ptr acceptor( new tcp::acceptor( m_pool.get_io_service( shard ) ) );
+
+            try
+            {
+                acceptor->open( endpoint.protocol() );
+                acceptor->set_option( tcp::acceptor::reuse_address( true ) );
+                acceptor->set_option( reuse_port( true ) );
+                acceptor->bind( endpoint );
+                acceptor->listen();
+            }
+            catch( boost::system::system_error& e )
+            {
+                if( inherited.empty() )
+                {
+                    throw;
+                }
+
+                // the old server didn't use reuse_port, its socket is all we get
+                TL_S_WARN << "can't add a reuseport acceptor to inherited port " << m_port << ": " << e.what();
+                break;
+            }
+
+            m_acceptors.push_back( std::move( acceptor ) );
+        }
+    }
+    else if( m_acceptors.empty() )
+    {
+        m_acceptors.emplace_back( new tcp::acceptor( io_service, endpoint ) );
+    }
+
     TL_S_DEBUG << "creating: " << *this;
-    do_accept();
+
+    for( std::size_t index = 0; index < m_acceptors.size(); ++index )
+    {
+        do_accept( index );
+    }
 }
 
-void chat_server::do_accept()
+void chat_server::do_accept( std::size_t index )
 {
-    m_acceptor.async_accept( m_socket,
-                            [this]( boost::system::error_code ec )
+    // with reuse_port acceptor index belongs to shard index and everything
+    // stays on that thread. otherwise the new connection is put on one of
+    // the pool's io_services from the start, we just do the accepting
+    std::size_t shard = m_options.reuse_port ? index % m_pool.size() : m_pool.next_index();
+    auto socket = std::make_shared<tcp::socket>( m_pool.get_io_service( shard ) );
+
+    m_acceptors[index]->async_accept( *socket,
+                            [this, index, socket, shard]( boost::system::error_code ec )
     {
+        if( ec == boost::asio::error::operation_aborted )
+        {
+            return; // stop_accepting()
+        }
+
         if( ec )
         {
             TL_S_ERROR << "accept error: " << ec.message();
         }
         else
         {
-            TL_S_INFO << "accepted connection from: " << m_socket.remote_endpoint();
-            auto session = std::make_shared<chat_session>( std::move( m_socket ), m_room );
-            session->start();
+            TL_S_INFO << "accepted connection from: " << socket->remote_endpoint() << " on shard " << shard;
+            auto session = std::allocate_shared<chat_session>( slab_allocator<chat_session>(),
+                                                              std::move( *socket ), m_registry, m_room, m_options, shard,
+                                                              m_pool.get_timer_wheel( shard ), m_sessions[shard] );
+
+            if( m_options.reuse_port )
+            {
+                session->start(); // already on the right thread
+            }
+            else
+            {
+                m_pool.get_io_service( shard ).post( [session]()
+                {
+                    session->start();
+                } );
+            }
         }
 
-        do_accept();
+        do_accept( index );
     } );
 }
 
+std::vector<int> chat_server::listening_fds() const
+{
+    std::vector<int> fds;
+
+    for( auto& acceptor : m_acceptors )
+    {
+        if( acceptor->is_open() )
+        {
+            fds.push_back( acceptor->native_handle() );
+        }
+    }
+
+    return fds;
+}
+
+void chat_server::stop_accepting()
+{
+    // each acceptor belongs to its io_service's thread, close it there
+    for( auto& a : m_acceptors )
+    {
+        tcp::acceptor* acceptor = a.get();
+
+        acceptor->get_io_service().post( [acceptor]()
+        {
+            boost::system::error_code ignored;
+            acceptor->close( ignored );
+        } );
+    }
+}
+
+void chat_server::drain( const std::string& reason )
+{
+    for( std::size_t shard = 0; shard < m_pool.size(); ++shard )
+    {
+        session_table* sessions = &m_sessions[shard];
+
+        m_pool.get_io_service( shard ).post( [sessions, reason]()
+        {
+            // copied, sessions leave the table as they close
+            std::vector<chat_session::pointer> draining;
+
+            for( chat_session* session : *sessions )
+            {
+                draining.push_back( session->shared_from_this() );
+            }
+
+            for( auto& session : draining )
+            {
+                session->drain( reason );
+            }
+        } );
+    }
+}
+
 std::ostream& operator<<( std::ostream& out, const chat_room& obj )
 {
     out << "room(" << obj.m_name << ")";
@@ -240,11 +1314,20 @@ std::ostream& operator<<( std::ostream& out, const chat_session& obj )
         // but m_socket.is_open is still true. happens when the
         // socket is closed but there are still outstanding events
         // to process
-        out << obj.m_room << "-" << obj.m_socket.remote_endpoint();
+        if( obj.m_current )
+        {
+            out << *obj.m_current;
+        }
+        else
+        {
+            out << "room()";
+        }
+
+        out << "-" << obj.m_socket.remote_endpoint();
     }
     catch( std::exception& e )
     {
-        out << "(E)"; // obj.m_room already printed out
+        out << "(E)"; // the room already printed out
     }
 
     return out;
@@ -252,6 +1335,12 @@ std::ostream& operator<<( std::ostream& out, const chat_session& obj )
 
 std::ostream& operator<<( std::ostream& out, const chat_server& obj )
 {
-    out << "chat_server: " << obj.m_acceptor.local_endpoint();
+    out << "chat_server: " << obj.m_acceptors.front()->local_endpoint();
+
+    if( obj.m_acceptors.size() > 1 )
+    {
+        out << " x" << obj.m_acceptors.size();
+    }
+
     return out;
 }
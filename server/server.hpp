@@ -10,64 +10,304 @@
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <mutex>
 
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 using boost::asio::ip::tcp;
 
 #include <msgpack.hpp>
 
 #include "common.hpp"
+#include "message_reader.hpp"
+#include "io_service_pool.hpp"
+#include "frame.hpp"
+#include "shard_exchange.hpp"
+#include "room_registry.hpp"
+#include "member_table.hpp"
+#include "handler_allocator.hpp"
+#include "journal_writer.hpp"
+#include "scrollback.hpp"
+#include "timer_wheel.hpp"
 
 class chat_room;
+typedef std::shared_ptr<chat_room> room_ptr;
+
+class chat_session;
+typedef member_table<chat_session>::handle member_handle;
+
+// every live session on one shard, so a drain can find them
+typedef member_table<chat_session> session_table;
+
+// tunables shared by every chat_server, filled in from the command line
+struct server_options
+{
+    // what to do when a session's outbound queue hits its high-water mark
+    enum overflow_policy
+    {
+        drop_oldest,    // throw away the oldest queued frames to make room
+        disconnect      // the reader can't keep up, kick them
+    };
+
+    std::size_t     queue_max_bytes = 1024 * 1024;
+    std::size_t     queue_max_msgs  = 4096;
+    overflow_policy queue_policy    = drop_oldest;
+
+    // every io thread gets its own SO_REUSEPORT acceptor instead of one
+    // acceptor handing sockets out round robin
+    bool            reuse_port      = false;
+
+    // frames each room keeps to send to new members, 0 turns it off
+    std::size_t     scrollback      = 32;
+
+    // an idle session holds a frame back for up to coalesce_window (or
+    // until coalesce_bytes are queued) so a burst goes out as one writev.
+    // zero writes straight away
+    std::chrono::microseconds coalesce_window { 0 };
+    std::size_t     coalesce_bytes  = 64 * 1024;
+
+    // socket options set on every session, 0 buffer sizes keep the kernel's.
+    // with tcp_cork partial segments are only pushed once the write queue
+    // drains
+    bool            tcp_nodelay     = false;
+    bool            tcp_cork        = false;
+    int             send_buffer     = 0;
+    int             recv_buffer     = 0;
+
+    // a session is slow once it has slow_bytes outstanding (queued plus in
+    // flight) or its current write has been stuck for slow_after. with
+    // latest_only a slow session keeps only the newest chat frame queued.
+    // one whose write is stuck for evict_after gets kicked. zero turns a
+    // check off
+    std::size_t     slow_bytes      = 256 * 1024;
+    std::chrono::milliseconds slow_after { 500 };
+    std::chrono::milliseconds evict_after { 30000 };
+    bool            latest_only     = false;
+
+    // ping a session after heartbeat without hearing from it, close it
+    // after idle_timeout. zero turns either off
+    std::chrono::milliseconds heartbeat { 30000 };
+    std::chrono::milliseconds idle_timeout { 90000 };
+};
 
 class chat_session : public std::enable_shared_from_this<chat_session>
 {
 public:
     typedef std::shared_ptr<chat_session> pointer;
 
-    chat_session( tcp::socket socket, chat_room& room );
+    chat_session( tcp::socket socket,
+                  room_registry& registry,
+                  room_ptr lobby,
+                  const server_options& options,
+                  std::size_t shard,
+                  timer_wheel& wheel,
+                  session_table& sessions );
     ~chat_session();
 
     tcp::socket& socket() { return m_socket; }
 
+    // which io_service_pool thread this session lives on
+    std::size_t shard() const { return m_shard; }
+
+    // what the peer negotiated to get big frames compressed with
+    compression::codec_t codec() const { return m_codec; }
+
     void start();
-    void deliver( const chat_message& msg );
+    void deliver( frame_t frame );
+
+    // the frames of a room's recent history that keep() picks, queued up
+    // and sent as a single write
+    template<typename Keep>
+    void deliver( const scrollback& history, Keep keep )
+    {
+        bool queued = false;
+
+        history.for_each( [this, &queued, &keep]( const scrollback::entry& e )
+        {
+            if( keep( e ) )
+            {
+                queued = enqueue( e.frame ) || queued;
+            }
+        } );
+
+        if( queued )
+        {
+            flush_or_wait();
+        }
+    }
+
     void close();
 
+    // say goodbye: leave every room, send a going_away, and hang up once
+    // the write queue has been flushed
+    void drain( const std::string& reason );
+
     friend std::ostream& operator<<( std::ostream& out, const chat_session& obj );
 
 private:
     void do_read();
+    void read_messages();
+    void read_frames();
+    void deliver_to( const room_ptr& room, mutable_frame_t& frame );
     void do_write();
+    void flush_or_wait();
+    void set_socket_options();
+    bool enqueue( const frame_t& frame );
+    bool over_high_water( std::size_t extra_bytes ) const;
+    void check_slow();
+    void supersede();
+    void disconnect_later();
+    void check_idle();
+    void schedule_idle();
+
+    void handle_control( const control_view& ctl );
+    void negotiate( const std::string& features );
+    void send_control( const room_ptr& room, unsigned command, const std::string& argument );
+    void join_room( room_ptr room );
+    void leave_room( room_ptr room );
+    room_ptr find_room( uint32_t id ) const;
+
+    // every room we get messages from, and our handle in its member table
+    struct membership
+    {
+        room_ptr        room;
+        member_handle   handle;
+    };
 
     tcp::socket m_socket;
-    chat_room& m_room;
+    room_registry& m_registry;
+    room_ptr m_lobby;               // the listening port's room, joined on start
+    std::vector<membership> m_rooms;
+    room_ptr m_current;             // the room our messages go to, may be null
+    const server_options& m_options;
+    std::size_t m_shard;
+    session_table& m_sessions;
+    member_handle m_session_handle;
+    bool m_draining;
 
-    typedef std::array<char, 1024> buffer_t;
-    buffer_t            m_read_buff;
-    buffer_t            m_write_buff;
+    // the plain msgpack stream until the client says hello and asks for
+    // framing, then frame_reader takes over. going out, frames queued
+    // before our hello reply still owe the peer the plain format
+    message_reader      m_reader;
+    frame_reader        m_frames;
+    bool                m_framed_in;
+    bool                m_framed_out;
+    std::size_t         m_unframed;
+    compression::codec_t m_codec;
 
-    msgpack::unpacker   m_unpacker;
-    msgpack::sbuffer    m_packer;
-    chat_message        m_msg;
+    // frames waiting for the current write to finish, and the frames (plus
+    // the buffer sequence pointing into them) of the one write in flight.
+    // vectors rather than a deque so their capacity sticks around and a
+    // busy session doesn't allocate
+    typedef std::vector<frame_t> frame_queue;
+    frame_queue         m_write_queue;
+    std::size_t         m_queued_bytes;
+    frame_queue         m_writing;
+    std::vector<boost::asio::const_buffer> m_write_bufs;
+    std::size_t         m_writing_bytes;
+    bool                m_closing;
+
+    // writes chain back to back, so while one is in flight this is also
+    // when the last one completed
+    std::chrono::steady_clock::time_point m_write_started;
+    bool                m_slow;
+
+    boost::asio::steady_timer m_flush_timer;   // the coalescing window
+    bool                m_flush_scheduled;
+
+    // reads just note the tick they happened on, the wheel entry wakes us
+    // when a ping or the timeout might be due and check_idle() works out
+    // whether it really is
+    timer_wheel&        m_wheel;
+    timer_wheel::entry  m_idle;
+    timer_wheel::tick_t m_last_read;
+    timer_wheel::tick_t m_heartbeat_ticks;
+    timer_wheel::tick_t m_idle_ticks;
+
+    // room for the one read and one write we ever have outstanding
+    handler_allocator   m_read_alloc;
+    handler_allocator   m_write_alloc;
+    handler_allocator   m_flush_alloc;
 };
 
-class chat_room
+class chat_room : public std::enable_shared_from_this<chat_room>
 {
 public:
 
-    chat_room( std::string name );
+    // journal may be null, the room's traffic then isn't recorded
+    chat_room( std::string name,
+               io_service_pool& pool,
+               shard_exchange& exchange,
+               room_journal* journal = nullptr,
+               std::size_t scrollback_frames = 0 );
+
+    // join, leave and deliver must be called from the member's own shard
+    // thread. joining sends the new member the room's recent frames
+    member_handle join( chat_session::pointer member );
+    void leave( chat_session::pointer member, member_handle handle );
+    void deliver( chat_session::pointer sender, frame_t frame );
+
+    // make the compressed copies of a frame this room's members will want,
+    // before it's delivered. once per broadcast however many members
+    void compress( frame& f ) const;
+
+    // a member switched codecs after joining
+    void codec_changed( compression::codec_t from, compression::codec_t to );
+
+    const std::string& name() const { return m_name; }
+
+    // unique for the life of the server, names the room in framed headers
+    uint32_t id() const { return m_id; }
+
+    // members over all shards, safe to call from any thread
+    std::size_t size() const { return m_size; }
+
+    // messages delivered to this room so far, safe to call from any thread
+    uint64_t msgs() const { return m_msgs.load( std::memory_order_relaxed ); }
 
-    void join( chat_session::pointer member );
-    void leave( chat_session::pointer member );
-    void deliver( chat_session::pointer sender, const chat_message& msg );
+    // null when the room isn't journaled
+    room_journal* journal() const { return m_journal; }
 
     friend std::ostream& operator<<( std::ostream& out, const chat_room& obj );
 
 private:
-    typedef std::set<chat_session::pointer> member_set;
-    member_set      m_members;
+    friend class shard_exchange;
+    void deliver_local( std::size_t shard, const chat_session* sender, const frame_t& frame );
+
+    // the shards besides except with members here, one bit each. shards
+    // past the 64th don't fit and are always counted in
+    uint64_t busy_shards( std::size_t except ) const;
+    static bool has_shard( uint64_t shards, std::size_t shard ) { return shard >= 64 || ( shards >> shard & 1 ); }
+
+    // members are split up by the shard they live on, each table is only
+    // ever touched by that shard's thread. a shard's table is made when its
+    // first member joins and goes again with its last, most rooms only ever
+    // see a few shards
+    typedef member_table<chat_session> members_t;
+    std::vector<std::unique_ptr<members_t>> m_members;
+
+    // members per shard, read by senders on every shard so frames aren't
+    // handed over to shards with nobody to give them to
+    std::unique_ptr<std::atomic<uint32_t>[]> m_shard_size;
+
+    // one history for the whole room, pushed to from the sender's shard and
+    // read by joins on any shard
+    std::mutex  m_history_mutex;
+    scrollback  m_history;
+    std::atomic<std::size_t> m_size;
+    std::atomic<uint64_t> m_msgs;
+
+    // members over all shards that want each codec
+    std::atomic<std::size_t> m_codec_members[compression::num_codecs];
+    shard_exchange& m_exchange;
+    room_journal*   m_journal;
     std::string     m_name;
+    uint32_t        m_id;
 };
 
 //----------------------------------------------------------------------
@@ -75,15 +315,41 @@ private:
 class chat_server
 {
 public:
+    // inherited are listening sockets taken over from the server we're
+    // replacing, they're used as they are instead of binding endpoint
     chat_server( boost::asio::io_service& io_service,
-                 const tcp::endpoint& endpoint );
+                 io_service_pool& pool,
+                 room_registry& registry,
+                 const tcp::endpoint& endpoint,
+                 const server_options& options,
+                 const std::vector<int>& inherited = std::vector<int>() );
+
+    unsigned short port() const { return m_port; }
+
+    // for handing over to a replacement, they stay ours too
+    std::vector<int> listening_fds() const;
+
+    // the first step of a drain, connections already accepted carry on
+    void stop_accepting();
+
+    // every session says goodbye and hangs up, see chat_session::drain()
+    void drain( const std::string& reason );
 
     friend std::ostream& operator<<( std::ostream& out, const chat_server& obj );
 
 private:
-    void do_accept();
+    void do_accept( std::size_t index );
+
+    // either one acceptor on the main io_service, or with reuse_port one
+    // per pool shard, each on that shard's io_service
+    typedef std::unique_ptr<tcp::acceptor> acceptor_ptr;
+    std::vector<acceptor_ptr> m_acceptors;
+    io_service_pool& m_pool;
+    room_registry&  m_registry;
+    room_ptr        m_room;     // the port's room, pinned so it's never swept
+    const server_options& m_options;
+    unsigned short  m_port;
 
-    tcp::acceptor   m_acceptor;
-    tcp::socket     m_socket;
-    chat_room       m_room;
+    // one per shard, each only touched from its own thread
+    std::vector<session_table> m_sessions;
 };
@@ -0,0 +1,105 @@
+#include "logger.hpp"
+#include "server.hpp"
+#include "shard_exchange.hpp"
+
+shard_exchange::shard_exchange( io_service_pool& pool, std::size_t ring_size )
+    : m_pool( pool ),
+      m_scheduled( new std::atomic<bool>[pool.size()] ),
+      m_drain_alloc( new handler_allocator[pool.size()] )
+{
+    // a shard delivers its own frames directly, it never needs a link to
+    // itself
+    for( std::size_t from = 0; from < pool.size(); ++from )
+    {
+        for( std::size_t to = 0; to < pool.size(); ++to )
+        {
+            m_links.emplace_back( from == to ? nullptr : new link( ring_size ) );
+        }
+    }
+
+    for( std::size_t i = 0; i < pool.size(); ++i )
+    {
+        m_scheduled[i] = false;
+    }
+}
+
+void shard_exchange::send( std::size_t from, std::size_t to, std::shared_ptr<chat_room> room, frame_t frame, uint64_t seq )
+{
+    link& l = get_link( from, to );
+    handoff h = { std::move( room ), std::move( frame ), seq };
+
+    // anything already in overflow has to go first to keep frames in order
+    if( ! l.overflow.empty() || ! l.ring.push( h ) )
+    {
+        l.overflow.push_back( std::move( h ) );
+
+        if( ! l.flush_scheduled )
+        {
+            TL_S_DEBUG << "shard " << from << " -> " << to << ": ring full, " << l.overflow.size() << " frames waiting";
+            l.flush_scheduled = true;
+            m_pool.get_io_service( from ).post( [this, from, to]()
+            {
+                flush( from, to );
+            } );
+        }
+    }
+
+    wake( to );
+}
+
+void shard_exchange::flush( std::size_t from, std::size_t to )
+{
+    link& l = get_link( from, to );
+    l.flush_scheduled = false;
+
+    while( ! l.overflow.empty() && l.ring.push( l.overflow.front() ) )
+    {
+        l.overflow.pop_front();
+    }
+
+    if( ! l.overflow.empty() )
+    {
+        // still backed up, give the receiver a chance to catch up
+        l.flush_scheduled = true;
+        m_pool.get_io_service( from ).post( [this, from, to]()
+        {
+            flush( from, to );
+        } );
+    }
+
+    wake( to );
+}
+
+void shard_exchange::wake( std::size_t to )
+{
+    if( ! m_scheduled[to].exchange( true ) )
+    {
+        m_pool.get_io_service( to ).post( make_custom_alloc_handler( m_drain_alloc[to], [this, to]()
+        {
+            drain( to );
+        } ) );
+    }
+}
+
+void shard_exchange::drain( std::size_t to )
+{
+    // clear the flag before draining, anything pushed after this point
+    // either gets drained now or schedules another drain
+    m_scheduled[to] = false;
+
+    for( std::size_t from = 0; from < m_pool.size(); ++from )
+    {
+        if( from == to )
+        {
+            continue;
+        }
+
+        link& l = get_link( from, to );
+
+        l.ring.consume_all( [to, &l]( const handoff& h )
+        {
+            h.room->deliver_local( to, nullptr, h.frame );
+            l.delivered = h.seq;
+        } );
+    }
+}
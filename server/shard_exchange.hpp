@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include <boost/lockfree/spsc_queue.hpp>
+
+#include "frame.hpp"
+#include "io_service_pool.hpp"
+#include "handler_allocator.hpp"
+
+class chat_room;
+
+// hands encoded frames from one shard's thread to another's without locks.
+// every (from, to) pair of shards has its own single producer, single
+// consumer ring. the receiving shard is only woken up with a post() when it
+// isn't already scheduled to drain, so the io_service's own queue sees one
+// post per drain rather than one per frame.
+//
+// there are size * ( size - 1 ) links, so the rings are kept small. a burst
+// that doesn't fit waits in the sender's overflow instead
+class shard_exchange
+{
+public:
+
+    explicit shard_exchange( io_service_pool& pool, std::size_t ring_size = 256 );
+
+    shard_exchange( const shard_exchange& ) = delete;
+    shard_exchange& operator=( const shard_exchange& ) = delete;
+
+    // must be called from shard from's thread. seq numbers the broadcast,
+    // it has to go up from one send to the next on the same shard
+    void send( std::size_t from, std::size_t to, std::shared_ptr<chat_room> room, frame_t frame, uint64_t seq );
+
+    // the seq of the last frame from shard from that shard to has
+    // delivered, anything later from from is still on its way. only
+    // meaningful on to's thread, and from != to
+    uint64_t delivered( std::size_t from, std::size_t to ) const { return get_link( from, to ).delivered; }
+
+private:
+
+    struct handoff
+    {
+        std::shared_ptr<chat_room> room; // keeps the room from being swept while in flight
+        frame_t     frame;
+        uint64_t    seq;
+    };
+
+    typedef boost::lockfree::spsc_queue<handoff> ring_t;
+
+    // one per (from, to) with from != to, only the ring is shared between threads. overflow
+    // holds whatever didn't fit and belongs to the producer alone, delivered
+    // to the consumer
+    struct link
+    {
+        explicit link( std::size_t ring_size ) : ring( ring_size ), flush_scheduled( false ), delivered( 0 ) {}
+
+        ring_t              ring;
+        std::deque<handoff> overflow;
+        bool                flush_scheduled;
+        uint64_t            delivered;
+    };
+
+    link& get_link( std::size_t from, std::size_t to ) { return *m_links[from * m_pool.size() + to]; }
+    const link& get_link( std::size_t from, std::size_t to ) const { return *m_links[from * m_pool.size() + to]; }
+
+    void flush( std::size_t from, std::size_t to );
+    void wake( std::size_t to );
+    void drain( std::size_t to );
+
+    io_service_pool&                    m_pool;
+    std::vector<std::unique_ptr<link>>  m_links;
+    std::unique_ptr<std::atomic<bool>[]> m_scheduled; // per receiving shard
+
+    // m_scheduled means there's at most one drain posted per shard, so each
+    // gets a single block of handler memory
+    std::unique_ptr<handler_allocator[]> m_drain_alloc;
+};
@@ -7,7 +7,8 @@
 using namespace std;
 
 SignalHandler::SignalHandler( boost::asio::io_service& ios )
-    : signals( ios, SIGINT, SIGTERM )
+    : signals( ios, SIGINT, SIGTERM, SIGUSR1 ),
+      m_terminating( false )
 {
     wait_for_signal();
 }
@@ -24,13 +25,33 @@ void SignalHandler::signal_handler( const boost::system::error_code& error, int
 
     switch( signal_number )
     {
-    case SIGUSR1: case SIGUSR2:
+    case SIGUSR1:
+        TL_S_INFO << "caught signal: " << signal_number;
+
+        if( m_on_usr1 )
+        {
+            m_on_usr1();
+        }
+
+        wait_for_signal();
+        break;
+
+    case SIGUSR2:
         TL_S_INFO << "caught signal: " << signal_number << " ignoring";
         wait_for_signal();
         break;
 
     case SIGHUP: case SIGINT: case SIGQUIT: case SIGKILL:
     default: // for now, just exit on any signal
+        if( m_on_terminate && ! m_terminating )
+        {
+            TL_S_INFO << "caught signal: " << signal_number << " draining, again to exit now";
+            m_terminating = true;
+            m_on_terminate();
+            wait_for_signal();
+            break;
+        }
+
         TL_S_INFO << "caught signal: " << signal_number << " exiting";
         signals.get_io_service().stop();
         break;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <signal.h>
+#include <functional>
 #include <boost/asio.hpp>
 
 class SignalHandler
@@ -9,6 +10,13 @@ public:
 
     SignalHandler( boost::asio::io_service& ios );
 
+    // called on SIGUSR1
+    void on_usr1( std::function<void()> fn ) { m_on_usr1 = fn; }
+
+    // called on the first SIGINT/SIGTERM instead of stopping the ios, a
+    // second one stops it straight away
+    void on_terminate( std::function<void()> fn ) { m_on_terminate = fn; }
+
 private:
 
     // stop the ios service when we get a term or ctrl-c
@@ -16,5 +24,8 @@ private:
     void wait_for_signal();
 
     boost::asio::signal_set signals;
+    std::function<void()> m_on_usr1;
+    std::function<void()> m_on_terminate;
+    bool m_terminating;
 };
 
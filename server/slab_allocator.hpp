@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+// hands out fixed size blocks carved from big slabs and keeps freed blocks on
+// a free list for the next one. slabs are never given back, the point is to
+// stop long running servers fragmenting the heap with objects (sessions)
+// that are created and destroyed all day. blocks can be freed on any thread.
+template<std::size_t BlockSize>
+class block_pool
+{
+public:
+    static block_pool& instance()
+    {
+        static block_pool pool;
+        return pool;
+    }
+
+    void* allocate()
+    {
+        std::lock_guard<std::mutex> lock( m_mutex );
+
+        if( ! m_free )
+        {
+            grow();
+        }
+
+        node* n = m_free;
+        m_free = n->next;
+        return n;
+    }
+
+    void deallocate( void* p )
+    {
+        std::lock_guard<std::mutex> lock( m_mutex );
+
+        node* n = static_cast<node*>( p );
+        n->next = m_free;
+        m_free = n;
+    }
+
+private:
+    enum { blocks_per_slab = 64 };
+
+    union node
+    {
+        node* next;
+        typename std::aligned_storage<BlockSize>::type storage;
+    };
+
+    block_pool() : m_free( nullptr ) {}
+
+    void grow()
+    {
+        std::unique_ptr<node[]> slab( new node[blocks_per_slab] );
+
+        for( std::size_t i = 0; i < blocks_per_slab; ++i )
+        {
+            slab[i].next = m_free;
+            m_free = &slab[i];
+        }
+
+        m_slabs.push_back( std::move( slab ) );
+    }
+
+    std::mutex m_mutex;
+    node* m_free;
+    std::vector<std::unique_ptr<node[]>> m_slabs;
+};
+
+// std allocator on top of block_pool, for std::allocate_shared. anything but
+// single objects goes to the heap
+template<typename T>
+class slab_allocator
+{
+public:
+    typedef T value_type;
+
+    slab_allocator() {}
+    template<typename U> slab_allocator( const slab_allocator<U>& ) {}
+
+    T* allocate( std::size_t n )
+    {
+        if( n == 1 )
+        {
+            return static_cast<T*>( block_pool<sizeof( T )>::instance().allocate() );
+        }
+
+        return static_cast<T*>( ::operator new( n * sizeof( T ) ) );
+    }
+
+    void deallocate( T* p, std::size_t n )
+    {
+        if( n == 1 )
+        {
+            block_pool<sizeof( T )>::instance().deallocate( p );
+            return;
+        }
+
+        ::operator delete( p );
+    }
+
+    template<typename U> struct rebind { typedef slab_allocator<U> other; };
+};
+
+template<typename T, typename U>
+bool operator==( const slab_allocator<T>&, const slab_allocator<U>& ) { return true; }
+
+template<typename T, typename U>
+bool operator!=( const slab_allocator<T>&, const slab_allocator<U>& ) { return false; }
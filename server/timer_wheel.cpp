@@ -0,0 +1,172 @@
+#include <algorithm>
+
+#include "timer_wheel.hpp"
+
+timer_wheel::timer_wheel( boost::asio::io_service& io_service, std::chrono::milliseconds tick )
+    : m_timer( io_service ),
+      m_tick( std::max( tick, std::chrono::milliseconds( 1 ) ) ),
+      m_now( 0 )
+{
+    for( auto& level : m_slots )
+    {
+        for( auto& head : level )
+        {
+            head.prev = head.next = &head;
+        }
+    }
+}
+
+timer_wheel::~timer_wheel()
+{
+    stop();
+
+    // whatever's still scheduled may well outlive us (sessions stuck in the
+    // io_service's queue get destroyed after the pool's wheels), leave them
+    // unlinked so their destructors don't touch our slots
+    for( auto& level : m_slots )
+    {
+        for( auto& head : level )
+        {
+            link* l = head.next;
+
+            while( l != &head )
+            {
+                link* next = l->next;
+                l->prev = l->next = nullptr;
+                l = next;
+            }
+
+            head.prev = head.next = &head;
+        }
+    }
+}
+
+void timer_wheel::start()
+{
+    m_next_tick = std::chrono::steady_clock::now() + m_tick;
+    wait();
+}
+
+void timer_wheel::stop()
+{
+    boost::system::error_code ignored;
+    m_timer.cancel( ignored );
+}
+
+void timer_wheel::wait()
+{
+    m_timer.expires_at( m_next_tick );
+    m_timer.async_wait( [this]( boost::system::error_code ec )
+    {
+        if( ec )
+        {
+            return;
+        }
+
+        // a busy thread can wake up late, catch up on every tick we missed.
+        // stepping m_next_tick rather than restarting from now() keeps the
+        // wheel from drifting
+        auto now = std::chrono::steady_clock::now();
+
+        while( m_next_tick <= now )
+        {
+            advance();
+            m_next_tick += m_tick;
+        }
+
+        wait();
+    } );
+}
+
+void timer_wheel::schedule( entry& e, tick_t at )
+{
+    e.cancel();
+    e.m_expires = std::max( at, m_now + 1 );
+    insert( e );
+}
+
+void timer_wheel::insert( entry& e )
+{
+    tick_t delta = e.m_expires - m_now;
+    tick_t at = e.m_expires;
+    unsigned level = 0;
+
+    while( level < levels - 1 && delta >> ( slot_bits * ( level + 1 ) ) )
+    {
+        level++;
+    }
+
+    if( delta >> ( slot_bits * levels ) )
+    {
+        // further out than the wheel reaches, park it in the last slot
+        // and it gets put back when that comes round
+        at = m_now + ( tick_t( 1 ) << ( slot_bits * levels ) ) - 1;
+    }
+
+    push_back( m_slots[level][( at >> ( slot_bits * level ) ) & ( slots - 1 )], e );
+}
+
+void timer_wheel::cascade( unsigned level )
+{
+    link& head = m_slots[level][( m_now >> ( slot_bits * level ) ) & ( slots - 1 )];
+
+    while( head.next != &head )
+    {
+        entry& e = static_cast<entry&>( *head.next );
+        e.cancel();
+        insert( e );
+    }
+}
+
+void timer_wheel::advance()
+{
+    m_now++;
+
+    // every time a level wraps, the next level's slot for the stretch we
+    // just moved into spills down. top down, so what falls out of a high
+    // level lands in a lower slot that's about to be spilled too
+    unsigned top = 0;
+
+    while( top < levels - 1 && ( m_now & ( ( tick_t( 1 ) << ( slot_bits * ( top + 1 ) ) ) - 1 ) ) == 0 )
+    {
+        top++;
+    }
+
+    for( unsigned level = top; level > 0; --level )
+    {
+        cascade( level );
+    }
+
+    // move the due slot's entries onto a list of our own first, callbacks
+    // are free to schedule or cancel anything, themselves included
+    link& head = m_slots[0][m_now & ( slots - 1 )];
+    link due;
+
+    if( head.next == &head )
+    {
+        return;
+    }
+
+    due.next = head.next;
+    due.prev = head.prev;
+    due.next->prev = &due;
+    due.prev->next = &due;
+    head.prev = head.next = &head;
+
+    while( due.next != &due )
+    {
+        entry& e = static_cast<entry&>( *due.next );
+        e.cancel();
+
+        if( e.m_expires > m_now )
+        {
+            insert( e ); // parked past the end of the wheel
+            continue;
+        }
+
+        if( e.callback )
+        {
+            e.callback();
+        }
+    }
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+// a hierarchical timer wheel, one per io thread. time moves in ticks and
+// each of the levels splits the ticks ahead of us into slots, the first
+// level one tick per slot, the next slots ticks per slot and so on. a timer
+// goes in the slot its expiry lands in on the finest level that reaches
+// that far, and whenever the first level wraps the next level's slot for
+// the coming stretch is spilled down into it. scheduling, cancelling and
+// each tick are O(1) however many timers there are, so every session can
+// have one without a deadline_timer (and a kernel timer) each.
+//
+//     timer_wheel::entry e;
+//     e.callback = [](){ ... };
+//     wheel.schedule( e, wheel.now() + wheel.ticks( std::chrono::seconds( 5 ) ) );
+//
+// entries unlink themselves when destroyed. a wheel and its entries must
+// only be touched from the wheel's io thread
+class timer_wheel
+{
+public:
+    typedef uint64_t tick_t;
+
+    enum
+    {
+        slot_bits = 6,
+        slots = 1 << slot_bits,
+        levels = 4      // 2^24 ticks ahead, over 19 days at 100ms a tick
+    };
+
+    struct link
+    {
+        link*   prev = nullptr;
+        link*   next = nullptr;
+    };
+
+    class entry : private link
+    {
+    public:
+        entry() = default;
+        entry( const entry& ) = delete;
+        entry& operator=( const entry& ) = delete;
+
+        ~entry() { cancel(); }
+
+        bool scheduled() const { return next != nullptr; }
+
+        void cancel()
+        {
+            if( next )
+            {
+                prev->next = next;
+                next->prev = prev;
+                prev = next = nullptr;
+            }
+        }
+
+        // called from the wheel's thread once the entry expires, it's no
+        // longer scheduled by then so it can schedule itself again
+        std::function<void()> callback;
+
+    private:
+        friend class timer_wheel;
+        tick_t  m_expires = 0;
+    };
+
+    timer_wheel( boost::asio::io_service& io_service, std::chrono::milliseconds tick );
+    ~timer_wheel();
+
+    timer_wheel( const timer_wheel& ) = delete;
+    timer_wheel& operator=( const timer_wheel& ) = delete;
+
+    // start ticking, call before the io thread runs or from it
+    void start();
+    void stop();
+
+    // ticks since start(), cheap enough to call on every read
+    tick_t now() const { return m_now; }
+
+    // how many ticks cover d, rounded up
+    tick_t ticks( std::chrono::milliseconds d ) const
+    {
+        return ( d.count() + m_tick.count() - 1 ) / m_tick.count();
+    }
+
+    // (re)schedule e to fire at tick at, anything not after now() fires
+    // on the next tick
+    void schedule( entry& e, tick_t at );
+
+    // move time on by one tick, firing whatever's due
+    void advance();
+
+private:
+    void wait();
+    void cascade( unsigned level );
+    void insert( entry& e );
+
+    static void push_back( link& head, link& l )
+    {
+        l.prev = head.prev;
+        l.next = &head;
+        head.prev->next = &l;
+        head.prev = &l;
+    }
+
+    boost::asio::steady_timer   m_timer;
+    std::chrono::milliseconds   m_tick;
+    std::chrono::steady_clock::time_point m_next_tick;
+    tick_t                      m_now;
+
+    // circular lists, each head links to itself when the slot is empty
+    link                        m_slots[levels][slots];
+};